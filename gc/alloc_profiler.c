@@ -0,0 +1,311 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+
+#include <flup/concurrency/mutex.h>
+#include <flup/core/logger.h>
+
+#include "alloc_profiler.h"
+#include "memory/alloc_tracker.h"
+#include "platform/platform.h"
+
+#undef FLUP_LOG_CATEGORY
+#define FLUP_LOG_CATEGORY "Alloc Profiler"
+
+struct alloc_profiler* alloc_profiler_new(size_t sampleInterval) {
+  struct alloc_profiler* self = malloc(sizeof(*self));
+  if (!self)
+    return NULL;
+
+  *self = (struct alloc_profiler) {
+    .sampleInterval = sampleInterval,
+    .liveCapacity = ALLOC_PROFILER_LIVE_TABLE_INITIAL_CAPACITY
+  };
+
+  if (!(self->lock = flup_mutex_new()))
+    goto failure;
+  if (!(self->live = calloc(self->liveCapacity, sizeof(*self->live))))
+    goto failure;
+  return self;
+
+failure:
+  alloc_profiler_free(self);
+  return NULL;
+}
+
+void alloc_profiler_free(struct alloc_profiler* self) {
+  if (!self)
+    return;
+
+  for (size_t i = 0; i < ALLOC_PROFILER_SITE_TABLE_SIZE; i++) {
+    struct alloc_profiler_site* next = self->sites[i];
+    while (next) {
+      struct alloc_profiler_site* current = next;
+      next = next->next;
+      free(current);
+    }
+  }
+
+  free(self->live);
+  flup_mutex_free(self->lock);
+  free(self);
+}
+
+// xorshift64*, doesn't need to be good just cheap
+static uint64_t nextRandom(struct alloc_profiler_thread_state* state) {
+  uint64_t x = state->randomState;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  state->randomState = x;
+  return x * 2685821657736338717llu;
+}
+
+// Gaps between samples of Poisson process are exponentially
+// distributed, -ln(U) * mean where U uniform in (0, 1]
+static size_t pickNextInterval(struct alloc_profiler* self, struct alloc_profiler_thread_state* state) {
+  double uniform = (double) ((nextRandom(state) >> 11) + 1) / (double) (1llu << 53);
+  return (size_t) (-log(uniform) * (double) self->sampleInterval) + 1;
+}
+
+void alloc_profiler_init_thread_state(struct alloc_profiler* self, struct alloc_profiler_thread_state* state) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  // Threads starting at same time still get different sequence
+  uint64_t seed = ((uint64_t) (uintptr_t) state) ^ ((uint64_t) now.tv_sec * 1'000'000'000llu + (uint64_t) now.tv_nsec);
+  seed *= 11400714819323198485llu;
+
+  *state = (struct alloc_profiler_thread_state) {
+    .randomState = seed != 0 ? seed : 1
+  };
+  state->bytesUntilSample = pickNextInterval(self, state);
+}
+
+static uint64_t hashFrames(void** frames, int frameCount) {
+  // FNV-1a over the addresses
+  uint64_t hash = 14695981039346656037llu;
+  for (int i = 0; i < frameCount; i++) {
+    hash ^= (uint64_t) (uintptr_t) frames[i];
+    hash *= 1099511628211llu;
+  }
+  return hash;
+}
+
+// Returns NULL if out of memory
+static struct alloc_profiler_site* getSite(struct alloc_profiler* self, void** frames, int frameCount) {
+  uint64_t hash = hashFrames(frames, frameCount);
+  struct alloc_profiler_site** bucket = &self->sites[hash % ALLOC_PROFILER_SITE_TABLE_SIZE];
+
+  for (struct alloc_profiler_site* current = *bucket; current; current = current->next)
+    if (current->hash == hash && current->frameCount == frameCount && memcmp(current->frames, frames, sizeof(void*) * (size_t) frameCount) == 0)
+      return current;
+
+  struct alloc_profiler_site* site = malloc(sizeof(*site));
+  if (!site)
+    return NULL;
+
+  *site = (struct alloc_profiler_site) {
+    .next = *bucket,
+    .hash = hash,
+    .frameCount = frameCount
+  };
+  memcpy(site->frames, frames, sizeof(void*) * (size_t) frameCount);
+  *bucket = site;
+  return site;
+}
+
+static size_t hashBlock(struct alloc_unit* block) {
+  // Fibonacci hashing, the lower bits of pointer mostly zero due alignment
+  return (size_t) (((uintptr_t) block >> 4) * 11400714819323198485llu);
+}
+
+static size_t findSlot(struct alloc_profiler_sample* live, size_t capacity, struct alloc_unit* block) {
+  size_t index = hashBlock(block) & (capacity - 1);
+  while (live[index].block != NULL && live[index].block != block)
+    index = (index + 1) & (capacity - 1);
+  return index;
+}
+
+static bool growLiveTable(struct alloc_profiler* self) {
+  size_t newCapacity = self->liveCapacity * 2;
+  struct alloc_profiler_sample* newLive = calloc(newCapacity, sizeof(*newLive));
+  if (!newLive)
+    return false;
+
+  for (size_t i = 0; i < self->liveCapacity; i++) {
+    if (self->live[i].block == NULL)
+      continue;
+    newLive[findSlot(newLive, newCapacity, self->live[i].block)] = self->live[i];
+  }
+
+  free(self->live);
+  self->live = newLive;
+  self->liveCapacity = newCapacity;
+  return true;
+}
+
+// Backward shift deletion so lookups never need tombstones
+static void removeSlot(struct alloc_profiler* self, size_t index) {
+  size_t mask = self->liveCapacity - 1;
+  size_t current = index;
+  while (true) {
+    current = (current + 1) & mask;
+    if (self->live[current].block == NULL)
+      break;
+
+    // Entry can move into the hole only if its home slot
+    // isn't cyclically between the hole and where it is
+    size_t home = hashBlock(self->live[current].block) & mask;
+    bool canMove = index <= current ? (home <= index || home > current) : (home <= index && home > current);
+    if (canMove) {
+      self->live[index] = self->live[current];
+      index = current;
+    }
+  }
+
+  self->live[index] = (struct alloc_profiler_sample) {};
+  self->liveCount--;
+}
+
+void alloc_profiler_record_alloc(struct alloc_profiler* self, struct alloc_profiler_thread_state* state, struct alloc_unit* block, size_t size) {
+  state->bytesUntilSample = pickNextInterval(self, state);
+
+  // Skip this function, the stack starts from heap's allocation function
+  void* frames[ALLOC_PROFILER_MAX_FRAMES];
+  int frameCount = platform_capture_backtrace(frames, ALLOC_PROFILER_MAX_FRAMES, 1);
+  if (frameCount < 0)
+    frameCount = 0;
+
+  flup_mutex_lock(self->lock);
+  struct alloc_profiler_site* site = getSite(self, frames, frameCount);
+  if (!site)
+    goto out_of_memory;
+
+  // Keep load factor under 50%, table has lots of removal
+  if ((self->liveCount + 1) * 2 > self->liveCapacity && !growLiveTable(self))
+    goto out_of_memory;
+
+  self->live[findSlot(self->live, self->liveCapacity, block)] = (struct alloc_profiler_sample) {
+    .block = block,
+    .site = site,
+    .size = size,
+    .allocCycle = self->cycleCount
+  };
+  self->liveCount++;
+
+  site->allocCount++;
+  site->allocSize += size;
+  site->liveCount++;
+  site->liveSize += size;
+  flup_mutex_unlock(self->lock);
+
+  alloc_unit_set_sampled(block, true);
+  return;
+
+out_of_memory:
+  flup_mutex_unlock(self->lock);
+  pr_warn("Out of memory recording allocation sample, dropping it");
+}
+
+static unsigned int ageBucket(uint64_t age) {
+  if (age == 0)
+    return 0;
+
+  unsigned int bucket = (unsigned int) (64 - __builtin_clzll(age));
+  return bucket < ALLOC_PROFILER_AGE_BUCKETS ? bucket : ALLOC_PROFILER_AGE_BUCKETS - 1;
+}
+
+void alloc_profiler_record_death(struct alloc_profiler* self, struct alloc_unit* block) {
+  // Dead block may be recycled, don't let it look sampled
+  alloc_unit_set_sampled(block, false);
+
+  flup_mutex_lock(self->lock);
+  size_t index = findSlot(self->live, self->liveCapacity, block);
+  struct alloc_profiler_sample* sample = &self->live[index];
+  if (sample->block == NULL) {
+    flup_mutex_unlock(self->lock);
+    return;
+  }
+
+  struct alloc_profiler_site* site = sample->site;
+  uint64_t age = self->cycleCount - sample->allocCycle;
+  site->liveCount--;
+  site->liveSize -= sample->size;
+  site->deathCount++;
+  site->totalAge += age;
+  site->ageHistogram[ageBucket(age)]++;
+  removeSlot(self, index);
+  flup_mutex_unlock(self->lock);
+}
+
+void alloc_profiler_end_cycle(struct alloc_profiler* self) {
+  flup_mutex_lock(self->lock);
+  self->cycleCount++;
+  flup_mutex_unlock(self->lock);
+}
+
+static void writeSite(FILE* file, struct alloc_profiler_site* site) {
+  fprintf(file, "%" PRIu64 ": %zu [%" PRIu64 ": %zu] @", site->liveCount, site->liveSize, site->allocCount, site->allocSize);
+  for (int i = 0; i < site->frameCount; i++)
+    fprintf(file, " 0x%" PRIxPTR, (uintptr_t) site->frames[i]);
+  fputc('\n', file);
+
+  if (site->deathCount == 0)
+    return;
+
+  fprintf(file, "# age: %" PRIu64 " died, mean %.2f cycles, histogram", site->deathCount, (double) site->totalAge / (double) site->deathCount);
+  for (unsigned int i = 0; i < ALLOC_PROFILER_AGE_BUCKETS; i++) {
+    uint64_t lower = i == 0 ? 0 : 1llu << (i - 1);
+    uint64_t upper = (1llu << i) - 1;
+    if (i == ALLOC_PROFILER_AGE_BUCKETS - 1)
+      fprintf(file, " %" PRIu64 "+:", lower);
+    else if (lower == upper)
+      fprintf(file, " %" PRIu64 ":", lower);
+    else
+      fprintf(file, " %" PRIu64 "-%" PRIu64 ":", lower, upper);
+    fprintf(file, "%" PRIu64, site->ageHistogram[i]);
+  }
+  fputc('\n', file);
+}
+
+int alloc_profiler_write(struct alloc_profiler* self, const char* path) {
+  FILE* file = fopen(path, "w");
+  if (!file)
+    return -errno;
+
+  flup_mutex_lock(self->lock);
+  uint64_t liveCount = 0;
+  size_t liveSize = 0;
+  uint64_t allocCount = 0;
+  size_t allocSize = 0;
+  for (size_t i = 0; i < ALLOC_PROFILER_SITE_TABLE_SIZE; i++) {
+    for (struct alloc_profiler_site* current = self->sites[i]; current; current = current->next) {
+      liveCount += current->liveCount;
+      liveSize += current->liveSize;
+      allocCount += current->allocCount;
+      allocSize += current->allocSize;
+    }
+  }
+
+  fprintf(file, "heap profile: %" PRIu64 ": %zu [%" PRIu64 ": %zu] @ heap_v2/%zu\n", liveCount, liveSize, allocCount, allocSize, self->sampleInterval);
+  for (size_t i = 0; i < ALLOC_PROFILER_SITE_TABLE_SIZE; i++)
+    for (struct alloc_profiler_site* current = self->sites[i]; current; current = current->next)
+      writeSite(file, current);
+  flup_mutex_unlock(self->lock);
+
+  fputs("\nMAPPED_LIBRARIES:\n", file);
+  int ret = platform_write_memory_map(file);
+  if (ret == -ENOSYS)
+    ret = 0;
+
+  if (fclose(file) != 0 && ret == 0)
+    ret = -errno;
+  return ret;
+}
@@ -0,0 +1,119 @@
+#ifndef UWU_5B0E7D3A_9C41_4F2E_8A6D_1E3F7C9B2A58_UWU
+#define UWU_5B0E7D3A_9C41_4F2E_8A6D_1E3F7C9B2A58_UWU
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <flup/concurrency/mutex.h>
+
+// Sampled allocation profiler. Roughly one allocation every
+// "sampleInterval" bytes has its call stack recorded, gaps
+// between samples are exponentially distributed like tcmalloc's
+// so every byte has same chance to be sampled and allocation
+// patterns which repeats can't hide from it
+//
+// Sampled objects are tagged in header (see alloc_unit_is_sampled)
+// and sweeper reports them when they die. Age is number of cycles
+// the object survived, sites where objects survive many cycles are
+// candidates for pretenuring
+//
+// Profile is written in pprof's legacy heap format (heap_v2) with
+// sampled counts as is, pprof scales them by itself. Age histogram
+// of each site follows its sample as comment line which pprof
+// ignores. On platforms without backtrace every sample goes
+// into single site with empty stack
+
+#define ALLOC_PROFILER_DEFAULT_SAMPLE_INTERVAL (512 * 1024)
+#define ALLOC_PROFILER_MAX_FRAMES (32)
+
+// Age buckets are 0, 1, 2-3, 4-7 and so on, last
+// one takes everything older
+#define ALLOC_PROFILER_AGE_BUCKETS (10)
+
+#define ALLOC_PROFILER_SITE_TABLE_SIZE (1024)
+#define ALLOC_PROFILER_LIVE_TABLE_INITIAL_CAPACITY (1024)
+
+struct alloc_unit;
+
+struct alloc_profiler_site {
+  struct alloc_profiler_site* next;
+  uint64_t hash;
+  int frameCount;
+  void* frames[ALLOC_PROFILER_MAX_FRAMES];
+
+  uint64_t allocCount;
+  size_t allocSize;
+
+  // Sampled objects which not swept yet
+  uint64_t liveCount;
+  size_t liveSize;
+
+  uint64_t deathCount;
+  uint64_t totalAge;
+  uint64_t ageHistogram[ALLOC_PROFILER_AGE_BUCKETS];
+};
+
+struct alloc_profiler_sample {
+  // NULL for empty slot
+  struct alloc_unit* block;
+  struct alloc_profiler_site* site;
+  size_t size;
+  uint64_t allocCycle;
+};
+
+// Each thread has its own, only touched by owner
+struct alloc_profiler_thread_state {
+  size_t bytesUntilSample;
+  uint64_t randomState;
+};
+
+struct alloc_profiler {
+  size_t sampleInterval;
+
+  // Protects everything below, only taken when sampling
+  // or when sweeper finds dead sampled object
+  flup_mutex* lock;
+
+  // Cycles completed since profiler created
+  uint64_t cycleCount;
+
+  // Chained by stack's hash
+  struct alloc_profiler_site* sites[ALLOC_PROFILER_SITE_TABLE_SIZE];
+
+  // Sampled objects not yet dead, open addressing table
+  // keyed by address with power of two capacity
+  size_t liveCount;
+  size_t liveCapacity;
+  struct alloc_profiler_sample* live;
+};
+
+struct alloc_profiler* alloc_profiler_new(size_t sampleInterval);
+void alloc_profiler_free(struct alloc_profiler* self);
+
+void alloc_profiler_init_thread_state(struct alloc_profiler* self, struct alloc_profiler_thread_state* state);
+
+// Cheap check done on every allocation, returns true if the
+// allocation must be passed to alloc_profiler_record_alloc
+static inline bool alloc_profiler_should_sample(struct alloc_profiler_thread_state* state, size_t size) {
+  if (state->bytesUntilSample > size) {
+    state->bytesUntilSample -= size;
+    return false;
+  }
+  return true;
+}
+
+// Must be called with GC blocked so sweeper can't see "block"
+// before it is recorded. Sample is dropped if out of memory
+void alloc_profiler_record_alloc(struct alloc_profiler* self, struct alloc_profiler_thread_state* state, struct alloc_unit* block, size_t size);
+
+// Called by sweeper for dead sampled blocks
+void alloc_profiler_record_death(struct alloc_profiler* self, struct alloc_unit* block);
+
+// Called by GC after sweeping
+void alloc_profiler_end_cycle(struct alloc_profiler* self);
+
+// Returns 0 or -errno, sampling and sweeping of sampled
+// objects wait while profile being written
+int alloc_profiler_write(struct alloc_profiler* self, const char* path);
+
+#endif
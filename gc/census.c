@@ -0,0 +1,140 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include <flup/core/panic.h>
+
+#include "census.h"
+
+struct gc_census* gc_census_new() {
+  struct gc_census* self = malloc(sizeof(*self));
+  if (!self)
+    return NULL;
+
+  *self = (struct gc_census) {
+    .capacity = GC_CENSUS_INITIAL_CAPACITY
+  };
+
+  if (!(self->entries = calloc(self->capacity, sizeof(*self->entries)))) {
+    free(self);
+    return NULL;
+  }
+  return self;
+}
+
+void gc_census_free(struct gc_census* self) {
+  if (!self)
+    return;
+
+  free(self->entries);
+  free(self);
+}
+
+struct gc_census* gc_census_copy(struct gc_census* self) {
+  struct gc_census* copy = malloc(sizeof(*copy));
+  if (!copy)
+    return NULL;
+
+  *copy = *self;
+  copy->lastEntry = NULL;
+  if (!(copy->entries = malloc(sizeof(*copy->entries) * self->capacity))) {
+    free(copy);
+    return NULL;
+  }
+  memcpy(copy->entries, self->entries, sizeof(*copy->entries) * self->capacity);
+  return copy;
+}
+
+void gc_census_reset(struct gc_census* self) {
+  memset(self->entries, 0, sizeof(*self->entries) * self->capacity);
+  self->blobEntry = (struct gc_census_entry) {};
+  self->entryCount = 0;
+  self->lastEntry = NULL;
+}
+
+static size_t hashDescriptor(struct descriptor* desc) {
+  // Fibonacci hashing, the lower bits of pointer mostly zero due alignment
+  return (size_t) (((uintptr_t) desc >> 4) * 11400714819323198485llu);
+}
+
+static struct gc_census_entry* findSlot(struct gc_census_entry* entries, size_t capacity, struct descriptor* desc) {
+  size_t index = hashDescriptor(desc) & (capacity - 1);
+  while (entries[index].desc != NULL && entries[index].desc != desc)
+    index = (index + 1) & (capacity - 1);
+  return &entries[index];
+}
+
+static void growTable(struct gc_census* self) {
+  size_t newCapacity = self->capacity * 2;
+  struct gc_census_entry* newEntries = calloc(newCapacity, sizeof(*newEntries));
+  if (!newEntries)
+    flup_panic("Error reserving memory for heap census");
+
+  for (size_t i = 0; i < self->capacity; i++) {
+    if (self->entries[i].desc == NULL)
+      continue;
+    *findSlot(newEntries, newCapacity, self->entries[i].desc) = self->entries[i];
+  }
+
+  free(self->entries);
+  self->entries = newEntries;
+  self->capacity = newCapacity;
+  self->lastEntry = NULL;
+}
+
+static struct gc_census_entry* getEntry(struct gc_census* self, struct descriptor* desc) {
+  if (!desc)
+    return &self->blobEntry;
+
+  if (self->lastEntry && self->lastEntry->desc == desc)
+    return self->lastEntry;
+
+  struct gc_census_entry* entry = findSlot(self->entries, self->capacity, desc);
+  if (entry->desc == NULL) {
+    // Keep load factor under 75%
+    if ((self->entryCount + 1) * 4 > self->capacity * 3) {
+      growTable(self);
+      entry = findSlot(self->entries, self->capacity, desc);
+    }
+
+    entry->desc = desc;
+    self->entryCount++;
+  }
+
+  self->lastEntry = entry;
+  return entry;
+}
+
+void gc_census_record_live(struct gc_census* self, struct descriptor* desc, size_t size) {
+  struct gc_census_entry* entry = getEntry(self, desc);
+  entry->liveObjectCount++;
+  entry->liveObjectSize += size;
+}
+
+void gc_census_record_sweeped(struct gc_census* self, struct descriptor* desc, size_t size) {
+  struct gc_census_entry* entry = getEntry(self, desc);
+  entry->sweepedObjectCount++;
+  entry->sweepedObjectSize += size;
+}
+
+bool gc_census_next(struct gc_census* self, struct gc_census_iterator* iterator) {
+  if (!iterator->blobEntryVisited) {
+    iterator->blobEntryVisited = true;
+    iterator->current = &self->blobEntry;
+    return true;
+  }
+
+  while (iterator->nextIndex < self->capacity) {
+    struct gc_census_entry* entry = &self->entries[iterator->nextIndex];
+    iterator->nextIndex++;
+
+    if (entry->desc == NULL)
+      continue;
+
+    iterator->current = entry;
+    return true;
+  }
+  return false;
+}
+
@@ -0,0 +1,67 @@
+#ifndef UWU_6E1C8B02_3D9A_4F5B_A0E7_92C4D1B7F3A8_UWU
+#define UWU_6E1C8B02_3D9A_4F5B_A0E7_92C4D1B7F3A8_UWU
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Per descriptor heap census, collected by the sweeper at end
+// of each cycle if enabled. Its a small hash table keyed by
+// descriptor pointer, objects without descriptor are counted
+// in seperate bucket
+
+#define GC_CENSUS_INITIAL_CAPACITY 64
+
+struct descriptor;
+
+struct gc_census_entry {
+  // NULL for objects without descriptor (plain blobs)
+  struct descriptor* desc;
+
+  uint64_t liveObjectCount;
+  size_t liveObjectSize;
+
+  uint64_t sweepedObjectCount;
+  size_t sweepedObjectSize;
+};
+
+struct gc_census {
+  // ID of the cycle which produced this census
+  uint64_t cycleID;
+
+  // Bucket for objects which has no descriptor
+  struct gc_census_entry blobEntry;
+
+  // Open addressing table, capacity is always power of two
+  // and empty slot has NULL desc
+  size_t entryCount;
+  size_t capacity;
+  struct gc_census_entry* entries;
+
+  // Small cache as objects of same type tend to be
+  // allocated next to each other
+  struct gc_census_entry* lastEntry;
+};
+
+struct gc_census_iterator {
+  size_t nextIndex;
+  bool blobEntryVisited;
+  struct gc_census_entry* current;
+};
+
+struct gc_census* gc_census_new();
+void gc_census_free(struct gc_census* self);
+
+// Returns a copy of the census or NULL if out of memory
+struct gc_census* gc_census_copy(struct gc_census* self);
+
+// Zero every counter but keep the table allocated
+void gc_census_reset(struct gc_census* self);
+
+void gc_census_record_live(struct gc_census* self, struct descriptor* desc, size_t size);
+void gc_census_record_sweeped(struct gc_census* self, struct descriptor* desc, size_t size);
+
+// Iterate every bucket, blob bucket included
+bool gc_census_next(struct gc_census* self, struct gc_census_iterator* iterator);
+
+#endif
+
@@ -2,14 +2,10 @@
 #include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <pthread.h>
 #include <time.h>
-#include <errno.h>
 #include <stddef.h>
 
-#include <flup/core/panic.h>
 #include <flup/core/logger.h>
-#include <flup/thread/thread.h>
 
 #include "gc/gc.h"
 #include "gc/stat_collector.h"
@@ -40,7 +36,7 @@ static size_t calcAverageTargetThreshold(struct gc_driver* self) {
 // Calculate second until "bytes" usage reached
 // based on current allocation rates
 static float calcTimeToUsage(struct gc_driver* self, size_t bytes) {
-  float heapUsage = (float) atomic_load(&self->gcState->ownerGen->allocTracker->currentUsage);
+  float heapUsage = (float) alloc_tracker_get_usage(self->gcState->ownerGen->allocTracker);
   float allocRate = (float) atomic_load(&self->statCollector->averageAllocRatePerSecond) + 1;
   float bytesFloat = (float) bytes;
   
@@ -59,64 +55,72 @@ static float getAdjustedAverageCycleTime(struct gc_driver* self) {
   return averageCycleTime;
 }
 
-static thread_local struct timespec deadline;
-static void doCollection(struct gc_driver* self) {
+static double getCurrentTime() {
+  struct timespec currentTimeSpec;
+  clock_gettime(CLOCK_REALTIME, &currentTimeSpec);
+  return (double) currentTimeSpec.tv_sec + ((double) currentTimeSpec.tv_nsec / 1e9f);
+}
+
+// Collection is asynchronous so one heap's cycle don't stop the
+// scheduler from driving other heaps. "afterCollection" is
+// combination of DRIVER_AFTER_* for what to do once cycle completes
+static void startCollection(struct gc_driver* self, unsigned int afterCollection) {
   atomic_store(&self->gcState->pacingMicrosec, 0);
-  struct timespec gcBeginAtSpec;
-  clock_gettime(CLOCK_REALTIME, &gcBeginAtSpec);
-  float gcBeginTime = (float) gcBeginAtSpec.tv_sec + ((float) gcBeginAtSpec.tv_nsec / 1e9f);
-  uint64_t cycleID = gc_start_cycle_async(self->gcState);
-  
-  float currentDelayMicrosec = 500;
-  float multiplier = 1.3f;
-  while (gc_wait_cycle(self->gcState, cycleID, &deadline) == -ETIMEDOUT) {
-    struct timespec currentTimeSpec;
-    clock_gettime(CLOCK_REALTIME, &currentTimeSpec);
-    
-    float timeSinceStart = ((float) currentTimeSpec.tv_sec + ((float) currentTimeSpec.tv_nsec / 1e9f)) - gcBeginTime;
-    float averageCycleTime = getAdjustedAverageCycleTime(self);
-    float timeUntilCycleCompletion = averageCycleTime - timeSinceStart;
-    
-    if (timeUntilCycleCompletion < 1.0f / DRIVER_CHECK_RATE_HZ)
-      timeUntilCycleCompletion = 1.0f / DRIVER_CHECK_RATE_HZ;
-    
-    if (calcTimeToUsage(self, self->gcState->ownerGen->allocTracker->maxSize) < timeUntilCycleCompletion) {
-      currentDelayMicrosec *= multiplier;
-      
-      // pr_info("Delayed by %f ms", currentDelayMicrosec / 1'000);
-      // Cap pace by 10 milisec
-      if (currentDelayMicrosec > 5'000)
-        currentDelayMicrosec = 10'000;
-      atomic_store_explicit(&self->gcState->pacingMicrosec, (unsigned int) currentDelayMicrosec, memory_order_relaxed);
-    }
-    
-    deadline.tv_nsec += 1'000'000'000 / DRIVER_CHECK_RATE_HZ;
-    if (deadline.tv_nsec >= 1'000'000'000) {
-      deadline.tv_nsec -= 1'000'000'000;
-      deadline.tv_sec++;
-    }
-  }
+  self->collectionBeginTime = getCurrentTime();
+  self->collectingCycleID = gc_start_cycle_async(self->gcState);
+  self->pacingDelayMicrosec = 500;
+  self->afterCollection = afterCollection;
+  self->collecting = true;
+}
+
+static void doCollection(struct gc_driver* self) {
+  startCollection(self, 0);
+}
+
+static void finishCollection(struct gc_driver* self) {
   atomic_store(&self->gcState->pacingMicrosec, 0);
+  self->collecting = false;
   
   size_t threshold = atomic_load(&self->gcState->bytesUsedRightBeforeSweeping);
   moving_window_append(self->triggerThresholdSamples, &threshold);
   
   atomic_store(&self->averagePeakMemoryBeforeCycle, calcAverageTargetThreshold(self));
   
-  struct timespec currentTime;
-  clock_gettime(CLOCK_REALTIME, &currentTime);
-  self->lastCollectionTime = (double) currentTime.tv_sec + ((double) currentTime.tv_nsec / 1e9f);
+  self->lastCollectionTime = getCurrentTime();
   self->lastCycleHeapUsage = atomic_load(&self->gcState->liveSetSize);
+  
+  if (self->afterCollection & DRIVER_AFTER_UPDATE_GROWTH_TRIGGER)
+    self->lastCycleHeapUsageSinceLastGrowthTrigger = self->lastCycleHeapUsage;
 }
 
-static bool maxCollectIntervalRule(struct gc_driver* self) {
-  struct timespec currentTimeSpec;
-  clock_gettime(CLOCK_REALTIME, &currentTimeSpec);
+// Pace mutators if heap is going to OOM before cycle completes
+static void updateCollection(struct gc_driver* self) {
+  if (gc_is_cycle_done(self->gcState, self->collectingCycleID)) {
+    finishCollection(self);
+    return;
+  }
   
-  double currentTime = (double) currentTimeSpec.tv_sec + ((double) currentTimeSpec.tv_nsec / 1e9f);
+  float timeSinceStart = (float) (getCurrentTime() - self->collectionBeginTime);
+  float averageCycleTime = getAdjustedAverageCycleTime(self);
+  float timeUntilCycleCompletion = averageCycleTime - timeSinceStart;
   
+  if (timeUntilCycleCompletion < 1.0f / DRIVER_CHECK_RATE_HZ)
+    timeUntilCycleCompletion = 1.0f / DRIVER_CHECK_RATE_HZ;
+  
+  if (calcTimeToUsage(self, self->gcState->ownerGen->allocTracker->maxSize) < timeUntilCycleCompletion) {
+    self->pacingDelayMicrosec *= 1.3f;
+    
+    // pr_info("Delayed by %f ms", self->pacingDelayMicrosec / 1'000);
+    // Cap pace by 10 milisec
+    if (self->pacingDelayMicrosec > 5'000)
+      self->pacingDelayMicrosec = 10'000;
+    atomic_store_explicit(&self->gcState->pacingMicrosec, (unsigned int) self->pacingDelayMicrosec, memory_order_relaxed);
+  }
+}
+
+static bool maxCollectIntervalRule(struct gc_driver* self) {
   // Time since last collection is too long
-  if (currentTime - self->lastCollectionTime > 5.0f) {
+  if (getCurrentTime() - self->lastCollectionTime > 5.0f) {
     doCollection(self);
     return true;
   }
@@ -127,13 +131,14 @@ static bool maxCollectIntervalRule(struct gc_driver* self) {
 static bool lowMemoryRule(struct gc_driver* self) {
   struct generation* gen = self->gcState->ownerGen;
   
-  size_t usage = atomic_load(&gen->allocTracker->currentUsage);
+  size_t usage = alloc_tracker_get_usage(gen->allocTracker);
   size_t softLimit = (size_t) ((float) gen->allocTracker->maxSize * 0.95f);
   
   // Start GC cycle so memory freed before mutator has to start
   // waiting on GC 
   if (usage > softLimit) {
     pr_verbose("Low memory rule: starting GC");
+    gc_notify_memory_pressure(self->gcState);
     doCollection(self);
     return true;
   }
@@ -142,20 +147,19 @@ static bool lowMemoryRule(struct gc_driver* self) {
 
 // Runs GC at 10%, 20%, 30%, 40%, and 50% to warm up statistics
 static bool warmUpRule(struct gc_driver* self) {
-  static thread_local int warmUpCurrentCount = 0;
-  if (warmUpCurrentCount >= 5)
+  if (self->warmUpCurrentCount >= 5)
     return false;
   
   struct generation* gen = self->gcState->ownerGen;
   
-  float warmPercent = 0.10f + (float) warmUpCurrentCount * 0.10f;
-  size_t usage = atomic_load(&gen->allocTracker->currentUsage);
+  float warmPercent = 0.10f + (float) self->warmUpCurrentCount * 0.10f;
+  size_t usage = alloc_tracker_get_usage(gen->allocTracker);
   size_t warmTrigger = (size_t) ((float) gen->allocTracker->maxSize * warmPercent);
   
   if (usage > warmTrigger) {
     pr_verbose("Warming GC at %.00f percent", warmPercent * 100);
     doCollection(self);
-    warmUpCurrentCount++;
+    self->warmUpCurrentCount++;
     return true;
   }
   return false;
@@ -175,7 +179,7 @@ static void preRunMatchingRateRule(struct gc_driver* self, struct polling_state*
   if (bytesLimit > (double) self->gcState->ownerGen->allocTracker->maxSize)
     bytesLimit = (double) self->gcState->ownerGen->allocTracker->maxSize;
   
-  double bytesToOOM = bytesLimit - (double) atomic_load(&self->gcState->ownerGen->allocTracker->currentUsage);
+  double bytesToOOM = bytesLimit - (double) alloc_tracker_get_usage(self->gcState->ownerGen->allocTracker);
   if (bytesToOOM < 0)
     bytesToOOM = 0;
   double secondsToOOM = (double) bytesToOOM / allocRate;
@@ -199,7 +203,7 @@ static bool matchingRateRule(struct gc_driver* self, struct polling_state* state
 
 static bool growthRule(struct gc_driver* self) {
   float heapSize = (float) self->gcState->ownerGen->allocTracker->maxSize;
-  float heapUsage = (float) atomic_load(&self->gcState->ownerGen->allocTracker->currentUsage);
+  float heapUsage = (float) alloc_tracker_get_usage(self->gcState->ownerGen->allocTracker);
   float allocRate = (float) atomic_load(&self->statCollector->averageAllocRatePerSecond) + 1;
   
   float nextTime = (float) atomic_load(&self->gcState->averageCycleTime);
@@ -215,14 +219,60 @@ static bool growthRule(struct gc_driver* self) {
     minGrowth = heapUsageSinceLastGrowth * 0.40f;
   
   if (heapUsageByNextTime > heapUsageSinceLastGrowth + minGrowth) {
-    doCollection(self);
-    self->lastCycleHeapUsageSinceLastGrowthTrigger = self->lastCycleHeapUsage;
+    startCollection(self, DRIVER_AFTER_UPDATE_GROWTH_TRIGGER);
     return true;
   }
   
   return false;
 }
 
+// Collect and give memory back once heap stops allocating
+// so next burst starts with clean heap and RSS drops while idle
+static bool idleRule(struct gc_driver* self) {
+  size_t allocRate = atomic_load(&self->statCollector->averageAllocRatePerSecond);
+  if (allocRate >= DRIVER_IDLE_ALLOC_RATE) {
+    self->idleSince = 0;
+    self->idleTrimmed = false;
+    return false;
+  }
+  
+  double currentTime = getCurrentTime();
+  if (self->idleSince == 0)
+    self->idleSince = currentTime;
+  
+  if (self->idleTrimmed || currentTime - self->idleSince < DRIVER_IDLE_DURATION)
+    return false;
+  
+  pr_verbose("Heap is idle, collecting and trimming");
+  gc_request_trim(self->gcState);
+  startCollection(self, 0);
+  self->idleTrimmed = true;
+  return true;
+}
+
+// Let mutator allocate long enough between cycles that GC's
+// CPU time over wall time stays at target fraction. If a cycle
+// takes C seconds of CPU and GC may use fraction f, mutators
+// get C * (1 - f) / f seconds worth of allocations on top of
+// last live set before next cycle
+static bool cpuBudgetRule(struct gc_driver* self, double targetFraction) {
+  struct alloc_tracker* tracker = self->gcState->ownerGen->allocTracker;
+  double cycleCPUTime = atomic_load(&self->gcState->averageCycleTime);
+  double allocRate = (double) (atomic_load(&self->statCollector->averageAllocRatePerSecond) + 1);
+  
+  double headroom = allocRate * cycleCPUTime * (1.0 - targetFraction) / targetFraction;
+  double trigger = (double) self->lastCycleHeapUsage + headroom;
+  if (trigger > (double) tracker->maxSize)
+    trigger = (double) tracker->maxSize;
+  
+  if ((double) alloc_tracker_get_usage(tracker) < trigger)
+    return false;
+  
+  pr_verbose("CPU budget rule: starting GC (trigger at %.2f MiB)", trigger / 1024.0 / 1024.0);
+  doCollection(self);
+  return true;
+}
+
 static void pollHeapState(struct gc_driver* self) {
   struct polling_state state = {};
   preRunMatchingRateRule(self, &state);
@@ -236,6 +286,17 @@ static void pollHeapState(struct gc_driver* self) {
   if (warmUpRule(self))
     return;
   
+  // Clean up heap when mutators went quiet
+  if (idleRule(self))
+    return;
+  
+  // Throughput oriented, replaces rules which trigger early
+  double targetFraction = self->gcState->options.targetCPUFraction;
+  if (targetFraction > 0.0 && targetFraction < 1.0) {
+    cpuBudgetRule(self, targetFraction);
+    return;
+  }
+  
   // Match GC with alloc rate
   // if (matchingRateRule(self, &state))
   //  return;
@@ -250,36 +311,18 @@ static void pollHeapState(struct gc_driver* self) {
     return;
 }
 
-static void driver(void* _self) {
-  struct gc_driver* self = _self;
-  
-  if (clock_gettime(CLOCK_REALTIME, &deadline) != 0)
-    flup_panic("Strange this implementation did not support CLOCK_REALTIME");
+void gc_driver_poll(struct gc_driver* self) {
+  if (atomic_load(&self->paused))
+    return;
   
-  pr_info("GC driver thread started!");
-  while (atomic_load(&self->quitRequested) == false) {
-    if (atomic_load(&self->paused) == true)
-      goto driver_was_paused;
-    
-    pollHeapState(self);
-    
-driver_was_paused:
-    // Any neater way to deal this??? TwT
-    deadline.tv_nsec += 1'000'000'000 / DRIVER_CHECK_RATE_HZ;
-    if (deadline.tv_nsec >= 1'000'000'000) {
-      deadline.tv_nsec -= 1'000'000'000;
-      deadline.tv_sec++;
-    }
-    
-    int ret = 0;
-    while ((ret = clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &deadline, NULL)) == EINTR)
-      ;
-    
-    if (ret != 0)
-      flup_panic("clock_nanosleep failed: %d", ret);
+  // Only one collection at a time, keep pacing it
+  // until completes
+  if (self->collecting) {
+    updateCollection(self);
+    return;
   }
   
-  pr_info("Requested to quit, quiting!");
+  pollHeapState(self);
 }
 
 struct gc_driver* gc_driver_new(struct gc_per_generation_state* gcState) {
@@ -297,8 +340,6 @@ struct gc_driver* gc_driver_new(struct gc_per_generation_state* gcState) {
   
   if (!(self->statCollector = stat_collector_new(gcState)))
     goto failure;
-  if (!(self->driverThread = flup_thread_new(driver, self)))
-    goto failure;
   return self;
 failure:
   gc_driver_free(self);
@@ -310,22 +351,10 @@ void gc_driver_unpause(struct gc_driver* self) {
   atomic_store(&self->paused, false);
 }
 
-void gc_driver_perform_shutdown(struct gc_driver* self) {
-  gc_driver_unpause(self);
-  atomic_store(&self->quitRequested, true);
-  
-  if (self->driverThread)
-    flup_thread_wait(self->driverThread);
-  
-  stat_collector_perform_shutdown(self->statCollector);
-}
-
 void gc_driver_free(struct gc_driver* self) {
   if (!self)
     return;
   
-  if (self->driverThread)
-    flup_thread_free(self->driverThread);
   stat_collector_free(self->statCollector);
   moving_window_free(self->triggerThresholdSamples);
   free(self);
@@ -3,8 +3,7 @@
 
 #include <stdatomic.h>
 #include <stddef.h>
-
-#include <flup/thread/thread.h>
+#include <stdint.h>
 
 #include "util/moving_window.h"
 
@@ -13,10 +12,16 @@
 
 #define DRIVER_TRIGGER_THRESHOLD_SAMPLES 20
 
+// Heap considered idle if allocation rate stays below
+// this for DRIVER_IDLE_DURATION seconds
+#define DRIVER_IDLE_ALLOC_RATE (1024 * 1024)
+#define DRIVER_IDLE_DURATION (2.0)
+
+// What driver does after collection it started completes
+#define DRIVER_AFTER_UPDATE_GROWTH_TRIGGER (1 << 0)
+
 struct gc_driver {
   struct gc_per_generation_state* gcState;
-  flup_thread* driverThread;
-  atomic_bool quitRequested;
   atomic_bool paused;
   
   struct stat_collector* statCollector;
@@ -27,12 +32,32 @@ struct gc_driver {
   double lastCollectionTime;
   size_t lastCycleHeapUsage;
   size_t lastCycleHeapUsageSinceLastGrowthTrigger;
+  
+  // When allocation rate went below idle threshold
+  // or 0 if its not idle
+  double idleSince;
+  // Only trim once per idle period
+  bool idleTrimmed;
+  
+  int warmUpCurrentCount;
+  
+  // Collection which driver started and still waiting
+  // to complete, driver paces mutators meanwhile
+  bool collecting;
+  uint64_t collectingCycleID;
+  double collectionBeginTime;
+  float pacingDelayMicrosec;
+  unsigned int afterCollection;
 };
 
 struct gc_driver* gc_driver_new(struct gc_per_generation_state* gcState);
 void gc_driver_free(struct gc_driver* self);
 
-void gc_driver_perform_shutdown(struct gc_driver* self);
 void gc_driver_unpause(struct gc_driver* self);
 
+// Evaluate heap state and start or pace collection, never
+// blocks. Called by runtime's scheduler DRIVER_CHECK_RATE_HZ
+// times a second
+void gc_driver_poll(struct gc_driver* self);
+
 #endif
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdatomic.h>
+#include <string.h>
 #include <time.h>
 
 #include <flup/bug.h>
@@ -14,17 +15,22 @@
 #include <flup/data_structs/list_head.h>
 #include <flup/core/panic.h>
 #include <flup/core/logger.h>
-#include <flup/data_structs/buffer/circular_buffer.h>
 #include <flup/data_structs/dyn_array.h>
-#include <flup/data_structs/buffer.h>
 
+#include "gc/alloc_profiler.h"
+#include "gc/census.h"
 #include "gc/driver.h"
 #include "gc/gc_lock.h"
+#include "gc/mark_stack.h"
+#include "gc/remark_buffer.h"
+#include "gc/runtime.h"
 #include "heap/heap.h"
 #include "heap/thread.h"
 #include "memory/alloc_tracker.h"
 #include "heap/generation.h"
 #include "object/descriptor.h"
+#include "object/ref.h"
+#include "platform/platform.h"
 #include "util/moving_window.h"
 
 #include "gc.h"
@@ -32,72 +38,100 @@
 #undef FLUP_LOG_CATEGORY
 #define FLUP_LOG_CATEGORY "GC"
 
+static bool getGCMarkedBitValue(struct gc_per_generation_state* self) {
+  return atomic_load_explicit(&self->GCMarkedBitValue, memory_order_relaxed);
+}
+
+static struct generation* getOwningGeneration(struct alloc_unit* block) {
+#ifdef CONFIG_OBJECT_COMPACT_HEADER
+  return generation_from_address(block);
+#else
+  return block->gcMetadata.owningGeneration;
+#endif
+}
+
 void gc_on_allocate(struct alloc_unit* block, struct generation* gen) {
-  block->gcMetadata.markBit = !gen->gcState->mutatorMarkedBitValue;
+  // Allocate "black", objects allocated during cycle are marked
+  // in GC's perspective and the same color become unmarked after
+  // GC flipped its meaning at the end of cycle
+  alloc_unit_store_mark_bit(block, gen->gcState->mutatorMarkedBitValue);
+#ifndef CONFIG_OBJECT_COMPACT_HEADER
   block->gcMetadata.owningGeneration = gen;
+#endif
 }
 
 void gc_need_remark(struct alloc_unit* obj) {
   if (!obj)
     return;
   
-  struct gc_block_metadata* metadata = &obj->gcMetadata;
-  struct gc_per_generation_state* gcState = metadata->owningGeneration->gcState;
+  struct generation* gen = getOwningGeneration(obj);
+  struct gc_per_generation_state* gcState = gen->gcState;
   
   // Add to queue if marking in progress
   if (!atomic_load_explicit(&gcState->markingInProgress, memory_order_acquire))
     return;
   
-  bool prevMarkBit = atomic_exchange_explicit(&metadata->markBit, gcState->GCMarkedBitValue, memory_order_relaxed);
-  if (prevMarkBit == gcState->GCMarkedBitValue)
+  bool markedValue = getGCMarkedBitValue(gcState);
+  bool prevMarkBit = alloc_unit_exchange_mark_bit(obj, markedValue);
+  if (prevMarkBit == markedValue)
     return;
   
   // Enqueue an pointer
-  struct thread* currentThread = heap_get_current_thread(obj->gcMetadata.owningGeneration->ownerHeap);
-  currentThread->localRemarkBuffer[currentThread->localRemarkBufferUsage] = obj;
-  currentThread->localRemarkBufferUsage++;
-  
-  // Local remark buffer is full, flush it to main queue in one go
-  if (currentThread->localRemarkBufferUsage == THREAD_LOCAL_REMARK_BUFFER_SIZE) {
-    flup_buffer_write_no_fail(gcState->needRemarkQueue, currentThread->localRemarkBuffer, sizeof(void*) * THREAD_LOCAL_REMARK_BUFFER_SIZE);
-    currentThread->localRemarkBufferUsage = 0;
-  }
+  struct thread* currentThread = heap_get_current_thread(gen->ownerHeap);
+  struct remark_buffer* buffer = currentThread->remarkBuffer;
+  buffer->entries[buffer->usage] = obj;
+  buffer->usage++;
+  
+  if (buffer->usage < GC_REMARK_BUFFER_ENTRIES)
+    return;
+  
+  // Buffer is full, hand it over to GC and get empty one
+  struct remark_buffer* newBuffer = remark_buffer_pool_get(gcState->remarkBufferPool);
+  if (!newBuffer)
+    flup_panic("Error reserving memory for remark buffer");
+  remark_buffer_pool_submit(gcState->remarkBufferPool, buffer);
+  currentThread->remarkBuffer = newBuffer;
 }
 
-static void gcThread(void* _self);
-struct gc_per_generation_state* gc_per_generation_state_new(struct generation* gen) {
+struct gc_per_generation_state* gc_per_generation_state_new(struct generation* gen, const struct gc_options* options) {
   struct gc_per_generation_state* self = malloc(sizeof(*self));
   if (!self)
     return NULL;
   
   *self = (struct gc_per_generation_state) {
-    .ownerGen = gen
+    .ownerGen = gen,
+    .options = *options,
+    // Objects allocated before first cycle must be unmarked
+    // in perspective of first cycle
+    .mutatorMarkedBitValue = true,
+    .GCMarkedBitValue = false
   };
   
+  self->options.cpuList = NULL;
+  self->options.runtime = NULL;
   if (!(self->cycleTimeSamples = moving_window_new(sizeof(double), GC_CYCLE_TIME_SAMPLE_COUNT)))
     goto failure;
   if (!(self->gcLock = gc_lock_new()))
     goto failure;
-  if (!(self->needRemarkQueue = flup_buffer_new(GC_MUTATOR_MARK_QUEUE_SIZE)))
+  if (!(self->remarkBufferPool = remark_buffer_pool_new()))
     goto failure;
   if (!(self->cycleStatusLock = flup_mutex_new()))
     goto failure;
   if (!(self->invokeCycleDoneEvent = flup_cond_new()))
     goto failure;
-  if (!(self->gcRequestLock = flup_mutex_new()))
-    goto failure;
-  if (!(self->gcRequestedCond = flup_cond_new()))
-    goto failure;
-  if (!(self->statsLock = flup_mutex_new()))
-    goto failure;
-  if (!(self->gcMarkQueueUwU = flup_circular_buffer_new(GC_MARK_QUEUE_SIZE)))
+  if (!(self->censusLock = flup_mutex_new()))
     goto failure;
-  if (!(self->deferredMarkQueue = flup_circular_buffer_new(GC_DEFERRED_MARK_QUEUE_SIZE)))
+  if (!(self->driver = gc_driver_new(self)))
     goto failure;
-  if (!(self->thread = flup_thread_new(gcThread, self)))
+  if (options->allocProfilerSampleInterval > 0 && !(self->allocProfiler = alloc_profiler_new(options->allocProfilerSampleInterval)))
     goto failure;
-  if (!(self->driver = gc_driver_new(self)))
+  
+  // No runtime given, heap gets its own runtime
+  struct gc_runtime* runtime = options->runtime;
+  if (!runtime && !(runtime = gc_runtime_new_with_memory_hint(options, 1, gen->allocTracker->arenaStart)))
     goto failure;
+  self->ownsRuntime = !options->runtime;
+  gc_runtime_register(runtime, self);
   return self;
 
 failure:
@@ -105,136 +139,74 @@ failure:
   return NULL;
 }
 
-static void callGCAsync(struct gc_per_generation_state* self, enum gc_request request) {
-  flup_mutex_lock(self->gcRequestLock);
-  self->gcRequest = request;
-  flup_cond_wake_one(self->gcRequestedCond);
-  flup_mutex_unlock(self->gcRequestLock);
-}
-
 void gc_perform_shutdown(struct gc_per_generation_state* self) {
-  gc_driver_perform_shutdown(self->driver);
+  if (!self->runtime)
+    return;
   
-  if (self->thread) {
-    callGCAsync(self, GC_SHUTDOWN);
-    flup_thread_wait(self->thread);
-  }
+  gc_runtime_unregister(self->runtime, self);
+  if (self->ownsRuntime)
+    gc_runtime_free(self->runtime);
+  self->runtime = NULL;
+  self->ownsRuntime = false;
 }
 
 void gc_per_generation_state_free(struct gc_per_generation_state* self) {
   if (!self)
     return;
   
+  gc_perform_shutdown(self);
   gc_driver_free(self->driver);
-  if (self->thread)
-    flup_thread_free(self->thread);
-  flup_circular_buffer_free(self->gcMarkQueueUwU);
-  flup_circular_buffer_free(self->deferredMarkQueue);
-  flup_mutex_free(self->statsLock);
-  flup_cond_free(self->gcRequestedCond);
-  flup_mutex_free(self->gcRequestLock);
+  alloc_profiler_free(self->allocProfiler);
+  flup_mutex_free(self->censusLock);
+  gc_census_free(self->lastCensus);
+  gc_census_free(self->workingCensus);
   flup_cond_free(self->invokeCycleDoneEvent);
   flup_mutex_free(self->cycleStatusLock);
   gc_lock_free(self->gcLock);
   free(self->snapshotOfRootSet);
-  flup_buffer_free(self->needRemarkQueue);
+  free(self->discoveredReferences);
+  remark_buffer_pool_free(self->remarkBufferPool);
   moving_window_free(self->cycleTimeSamples);
   free(self);
 }
 
-static bool markOneItem(struct gc_per_generation_state* state, struct alloc_unit* parent, size_t parentIndex, struct alloc_unit* fieldContent) {
-  if (!fieldContent)
-    return true;
-  
-  int ret;
-  if ((ret = flup_circular_buffer_write(state->gcMarkQueueUwU, &fieldContent, sizeof(void*))) < 0) {
-    struct gc_mark_state savedState = {
-      .block = parent,
-      .fieldIndex = parentIndex
-    };
-    
-    // If mark queue can't fit just put it in deferred mark queue
-    if ((ret = flup_circular_buffer_write(state->deferredMarkQueue, &savedState, sizeof(savedState))) < 0) {
-      size_t numOfFieldsToTriggerMarkQueueOverflow = (GC_MARK_QUEUE_SIZE / sizeof(void*)) + 1;
-      size_t numOfObjectsToTriggerRemarkQueueOverflow = (GC_DEFERRED_MARK_QUEUE_SIZE / sizeof(struct gc_mark_state)) + 1;
-      size_t perObjectBytesToTriggerMarkQueueOverflow = numOfFieldsToTriggerMarkQueueOverflow * sizeof(void*);
-      size_t totalBytesToTriggerRemarkQueueOverflow = numOfObjectsToTriggerRemarkQueueOverflow * perObjectBytesToTriggerMarkQueueOverflow;
-      flup_panic("!!Congrat!! You found very absurb condition with ~%lf TiB worth of bytes composed from %zu objects sized %zu bytes each (or %zu fields/array entries each) UwU", ((double) totalBytesToTriggerRemarkQueueOverflow) / 1024.0f / 1024.0f / 1024.0f / 1024.0f, numOfObjectsToTriggerRemarkQueueOverflow, perObjectBytesToTriggerMarkQueueOverflow, numOfFieldsToTriggerMarkQueueOverflow);
-    }
-    
-    return false;
-  }
-  return true;
-}
-
-static void doMarkInner(struct gc_per_generation_state* state, struct gc_mark_state* markState) {
-  struct alloc_unit* block = markState->block;
-  bool markBit = atomic_exchange_explicit(&block->gcMetadata.markBit, state->GCMarkedBitValue, memory_order_relaxed);
-  // Current item is already marked skip and fieldIndex equals zero
-  // mean its not a continuation from previous state
-  if (markState->fieldIndex == 0 && markBit == state->GCMarkedBitValue)
-    return;
-  
-  struct descriptor* desc = atomic_load_explicit(&block->desc, memory_order_acquire);
-  // Object have no GC-able references
-  if (!desc)
+static void discoverReference(struct gc_per_generation_state* state, struct alloc_unit* block) {
+  // Object with multiple weak/soft fields only need to be discovered once
+  if (state->discoveredReferencesCount > 0 && state->discoveredReferences[state->discoveredReferencesCount - 1] == block)
     return;
   
-  // Uses breadth first search but if failed
-  // queue current state to process later
-  size_t fieldIndex;
-  for (fieldIndex = markState->fieldIndex; fieldIndex < desc->fieldCount; fieldIndex++) {
-    size_t offset = desc->fields[fieldIndex].offset;
-    _Atomic(struct alloc_unit*)* fieldPtr = (_Atomic(struct alloc_unit*)*) ((void*) (((char*) block->data) + offset));
-    if (!markOneItem(state, block, fieldIndex, atomic_load_explicit(fieldPtr, memory_order_relaxed)))
-      return;
+  if (state->discoveredReferencesCount == state->discoveredReferencesCapacity) {
+    size_t newCapacity = state->discoveredReferencesCapacity * 2;
+    if (newCapacity == 0)
+      newCapacity = GC_DISCOVERED_REFERENCES_INITIAL_CAPACITY;
+    
+    struct alloc_unit** newList = realloc(state->discoveredReferences, newCapacity * sizeof(void*));
+    if (!newList)
+      flup_panic("Error reserving memory for discovered references list");
+    state->discoveredReferences = newList;
+    state->discoveredReferencesCapacity = newCapacity;
   }
   
-  if (!desc->hasFlexArrayField)
-    return;
-  
-  size_t flexArrayCount = (block->size - desc->objectSize) / sizeof(void*);
-  for (size_t i = 0; i < flexArrayCount; i++) {
-    _Atomic(struct alloc_unit*)* fieldPtr = (_Atomic(struct alloc_unit*)*) ((void*) (((char*) block->data) + desc->objectSize + i * sizeof(void*)));
-    if (!markOneItem(state, block, fieldIndex + i, atomic_load_explicit(fieldPtr, memory_order_relaxed)))
-      return;
-  }
+  state->discoveredReferences[state->discoveredReferencesCount] = block;
+  state->discoveredReferencesCount++;
 }
 
-static void processMarkQueue(struct gc_per_generation_state* state) {
-  int ret;
-  struct alloc_unit* current;
-  while ((ret = flup_circular_buffer_read(state->gcMarkQueueUwU, &current, sizeof(void*))) == 0) {
-    struct gc_mark_state markState = {
-      .block = current,
-      .fieldIndex = 0
-    };
-    doMarkInner(state, &markState);
+static bool isFieldTraced(struct gc_per_generation_state* state, struct field* field) {
+  switch (field->strength) {
+    case FIELD_STRONG:
+      return true;
+    case FIELD_SOFT:
+      return !state->clearSoftReferences;
+    case FIELD_WEAK:
+      return false;
   }
-  
-  if (ret != -ENODATA)
-    flup_panic("Error reading GC mark queue: %d", ret);
-}
-
-static void doMark(struct gc_per_generation_state* state, struct alloc_unit* block) {
-  int ret;
-  if ((ret = flup_circular_buffer_write(state->gcMarkQueueUwU, &block, sizeof(void*))) < 0)
-    flup_panic("Cannot enqueue to GC mark queue (configured queue size was %zu bytes): %d", (size_t) GC_MARK_QUEUE_SIZE, ret);
-  
-  processMarkQueue(state);
-  
-  struct gc_mark_state current;
-  while ((ret = flup_circular_buffer_read(state->deferredMarkQueue, &current, sizeof(current))) == 0) {
-    doMarkInner(state, &current);
-    processMarkQueue(state);
-  }
-  
-  if (ret != -ENODATA)
-    flup_panic("Error reading GC deferred mark queue: %d", ret);
+  flup_panic("Unreachable");
 }
 
 struct cycle_state {
   struct gc_per_generation_state* self;
+  // Mark stack owned by the thread running the cycle
+  struct mark_stack* markStack;
   struct alloc_tracker* arena;
   struct heap* heap;
   
@@ -243,71 +215,255 @@ struct cycle_state {
   
   struct timespec pauseBegin, pauseEnd;
   
+  // Start of current phase (see phaseBegin)
+  struct timespec phaseWallBegin, phaseCPUBegin;
+  
+  uint64_t tracedObjectCount;
+  size_t tracedObjectSize;
+  size_t sweepedThroughSize;
+  
   struct alloc_tracker_snapshot objectsListSnapshot;
+  
+  // NULL if census is not enabled for this cycle
+  struct gc_census* census;
 };
 
-static void takeRootSnapshotPhase(struct cycle_state* state) {
-  __block size_t totalRootRefs = 0;
-  heap_iterate_threads(state->heap, ^(struct thread* thrd) {
-    totalRootRefs += thrd->rootSize;
-  });
+// Push unmarked object to mark stack, checking the
+// mark bit first so marked objects don't go through stack
+static void markOneItem(struct cycle_state* state, struct alloc_unit* fieldContent) {
+  if (!fieldContent)
+    return;
   
-  struct alloc_unit** rootSnapshot = realloc(state->self->snapshotOfRootSet, totalRootRefs * sizeof(void*));
-  if (!rootSnapshot)
-    flup_panic("Error reserving memory for root set snapshot");
-  state->self->snapshotOfRootSet = rootSnapshot;
-  state->self->snapshotOfRootSetSize = totalRootRefs;
+  if (alloc_unit_load_mark_bit(fieldContent) == getGCMarkedBitValue(state->self))
+    return;
   
+  mark_stack_push(state->markStack, fieldContent);
+}
+
+static void doMarkInner(struct cycle_state* state, struct alloc_unit* block) {
+  struct gc_per_generation_state* self = state->self;
+  bool markedValue = getGCMarkedBitValue(self);
+  bool markBit = alloc_unit_exchange_mark_bit(block, markedValue);
+  // Current item is already marked skip
+  if (markBit == markedValue)
+    return;
+  
+  size_t size = alloc_unit_get_size(block);
+  state->tracedObjectCount++;
+  state->tracedObjectSize += size;
+  
+  struct descriptor* desc = alloc_unit_get_descriptor(block, memory_order_acquire);
+  // Object have no GC-able references
+  if (!desc)
+    return;
+  
+  void* refBase = self->ownerGen->allocTracker->refBase;
+  
+  // Depth first, the mark stack grows as needed
+  for (size_t fieldIndex = 0; fieldIndex < desc->fieldCount; fieldIndex++) {
+    if (!isFieldTraced(self, &desc->fields[fieldIndex])) {
+      discoverReference(self, block);
+      continue;
+    }
+    
+    markOneItem(state, object_ref_load(refBase, block->data, desc->fields[fieldIndex].offset));
+  }
+  
+  if (!desc->hasFlexArrayField)
+    return;
+  
+  size_t flexArrayCount = (size - desc->objectSize) / sizeof(object_ref);
+  for (size_t i = 0; i < flexArrayCount; i++)
+    markOneItem(state, object_ref_load(refBase, block->data, desc->objectSize + i * sizeof(object_ref)));
+}
+
+static void doMark(struct cycle_state* state, struct alloc_unit* block) {
+  if (!block)
+    return;
+  
+  mark_stack_push(state->markStack, block);
+  
+  struct alloc_unit* current;
+  while ((current = mark_stack_pop(state->markStack)))
+    doMarkInner(state, current);
+}
+
+// Threads may attach or detach while this runs as
+// walking threads don't lock them out, so done in one
+// pass growing the snapshot as needed
+static void takeRootSnapshotPhase(struct cycle_state* state) {
+  struct gc_per_generation_state* self = state->self;
   __block size_t index = 0;
+  __block size_t capacity = self->snapshotOfRootSetCapacity;
+  __block struct alloc_unit** rootSnapshot = self->snapshotOfRootSet;
+  
   heap_iterate_threads(state->heap, ^(struct thread* thrd) {
-    flup_list_head* current;
-    flup_list_for_each(&thrd->rootEntries, current) {
-      // Root set still has more items
-      BUG_ON(index >= totalRootRefs);
+    // Roots of detached thread are gone
+    if (atomic_load_explicit(&thrd->detached, memory_order_acquire))
+      return;
+    
+    if (index + thrd->rootSize > capacity) {
+      size_t newCapacity = capacity * 2;
+      if (newCapacity < index + thrd->rootSize)
+        newCapacity = index + thrd->rootSize;
       
-      rootSnapshot[index] = container_of(current, struct root_ref, node)->obj;
-      index++;
+      struct alloc_unit** newSnapshot = realloc(rootSnapshot, newCapacity * sizeof(void*));
+      if (!newSnapshot)
+        flup_panic("Error reserving memory for root set snapshot");
+      rootSnapshot = newSnapshot;
+      capacity = newCapacity;
     }
+    
+    thread_for_each_root_ref(thrd, ^(struct root_ref* ref) {
+      // Thread's root set bigger than it said
+      BUG_ON(index >= capacity);
+      
+      rootSnapshot[index] = ref->obj;
+      index++;
+    });
   });
   
-  // Root set somehow reduced in size
-  // or counted wrongly
-  BUG_ON(index != totalRootRefs);
+  self->snapshotOfRootSet = rootSnapshot;
+  self->snapshotOfRootSetCapacity = capacity;
+  self->snapshotOfRootSetSize = index;
 }
 
-static void markingPhase(struct cycle_state* state) {
-  for (size_t i = 0; i < state->self->snapshotOfRootSetSize; i++)
-    doMark(state->self, state->self->snapshotOfRootSet[i]);
+static void processRemarkBuffer(struct cycle_state* state, struct remark_buffer* buffer) {
+  for (size_t i = 0; i < buffer->usage; i++) {
+    struct alloc_unit* current = buffer->entries[i];
+    alloc_unit_store_mark_bit(current, !getGCMarkedBitValue(state->self));
+    doMark(state, current);
+  }
+  buffer->usage = 0;
 }
 
-static void processMutatorMarkQueuePhase(struct cycle_state* state) {
-  auto processAChunk = ^void (struct alloc_unit** chunk, unsigned int chunkSize) {
-    for (unsigned int i = 0; i < chunkSize; i++) {
-      struct alloc_unit* current = chunk[i];
-      atomic_store_explicit(&current->gcMetadata.markBit, !state->self->GCMarkedBitValue, memory_order_relaxed);
-      doMark(state->self, current);
-    }
-  };
+// Process remark buffers which mutators already handed over
+// this is safe to do concurrently with mutators as those
+// buffers no longer written by them. Returns number of buffers
+// processed
+static unsigned int drainCompletedRemarkBuffers(struct cycle_state* state) {
+  struct remark_buffer_pool* pool = state->self->remarkBufferPool;
+  struct remark_buffer* current = remark_buffer_pool_take_completed(pool);
+  unsigned int count = 0;
+  while (current) {
+    struct remark_buffer* next = current->next;
+    processRemarkBuffer(state, current);
+    remark_buffer_pool_put(pool, current);
+    current = next;
+    count++;
+  }
+  state->stats.lifetimeRemarkBufferCount += count;
+  return count;
+}
+
+static void markingPhase(struct cycle_state* state) {
+  for (size_t i = 0; i < state->self->snapshotOfRootSetSize; i++) {
+    doMark(state, state->self->snapshotOfRootSet[i]);
+    
+    // Drain mutator's remark buffers along the way so
+    // they don't pile up while roots still being marked
+    if (i % GC_REMARK_DRAIN_INTERVAL == 0)
+      drainCompletedRemarkBuffers(state);
+  }
   
-  // This is safe as mutator will only ever pushes THREAD_LOCAL_REMARK_BUFFER_SIZE
-  // items therefore the buffer content always multiple of this items
-  static thread_local struct alloc_unit* chunk[THREAD_LOCAL_REMARK_BUFFER_SIZE];
-  int ret;
-  while ((ret = flup_buffer_read2(state->self->needRemarkQueue, &chunk, sizeof(void*) * THREAD_LOCAL_REMARK_BUFFER_SIZE, FLUP_BUFFER_READ2_DONT_WAIT_FOR_DATA)) >= 0)
-    processAChunk(chunk, THREAD_LOCAL_REMARK_BUFFER_SIZE);
-  BUG_ON(ret == -EMSGSIZE);
-  
-  // Process each thread's local buffer
-  // for remaining unqueued entries
-  // it must be safe as mutator already
-  // stopped writing into its local buffer
-  // ensuring no race by this time
+  // Keep draining while mutator still producing lots,
+  // so final pass in the pause only has little left
+  for (int i = 0; i < GC_REMARK_DRAIN_MAX_ROUNDS; i++)
+    if (drainCompletedRemarkBuffers(state) == 0)
+      break;
+}
+
+// Final pass of mutator remark buffers, must be called while
+// mutators are paused because it process each thread's own
+// partially filled buffer
+static void finalRemarkPhase(struct cycle_state* state) {
+  drainCompletedRemarkBuffers(state);
   heap_iterate_threads(state->heap, ^(struct thread* thrd) {
-    processAChunk(thrd->localRemarkBuffer, thrd->localRemarkBufferUsage);
-    thrd->localRemarkBufferUsage = 0;
+    if (thrd->remarkBuffer->usage > 0)
+      state->stats.lifetimeFinalRemarkBufferCount++;
+    processRemarkBuffer(state, thrd->remarkBuffer);
   });
 }
 
+static void pauseAppThreads(struct cycle_state* state);
+static void unpauseAppThreads(struct cycle_state* state);
+
+static double timespecToSeconds(const struct timespec* time) {
+  return (double) time->tv_sec + (double) time->tv_nsec / 1'000'000'000.0;
+}
+
+static void phaseBegin(struct cycle_state* state) {
+  clock_gettime(CLOCK_MONOTONIC, &state->phaseWallBegin);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &state->phaseCPUBegin);
+}
+
+static void phaseEnd(struct cycle_state* state, enum gc_phase phase) {
+  struct timespec wallEnd, cpuEnd;
+  clock_gettime(CLOCK_MONOTONIC, &wallEnd);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuEnd);
+  
+  struct gc_phase_stats* stats = &state->stats.phases[phase];
+  stats->lastWallTime = timespecToSeconds(&wallEnd) - timespecToSeconds(&state->phaseWallBegin);
+  stats->lastCPUTime = timespecToSeconds(&cpuEnd) - timespecToSeconds(&state->phaseCPUBegin);
+  stats->lifetimeWallTime += stats->lastWallTime;
+  stats->lifetimeCPUTime += stats->lastCPUTime;
+}
+
+static void clearUnmarkedReferents(struct cycle_state* state) {
+  struct gc_per_generation_state* self = state->self;
+  void* refBase = self->ownerGen->allocTracker->refBase;
+  for (size_t i = 0; i < self->discoveredReferencesCount; i++) {
+    struct alloc_unit* block = self->discoveredReferences[i];
+    struct descriptor* desc = alloc_unit_get_descriptor(block, memory_order_acquire);
+    
+    for (size_t fieldIndex = 0; fieldIndex < desc->fieldCount; fieldIndex++) {
+      if (isFieldTraced(self, &desc->fields[fieldIndex]))
+        continue;
+      
+      size_t offset = desc->fields[fieldIndex].offset;
+      struct alloc_unit* referent = object_ref_load(refBase, block->data, offset);
+      if (!referent || alloc_unit_load_mark_bit(referent) == getGCMarkedBitValue(self))
+        continue;
+      
+      object_ref_store(refBase, block->data, offset, NULL);
+    }
+  }
+  
+  self->discoveredReferencesCount = 0;
+}
+
+// Marking must be still in progress until every remark buffer
+// is drained else mutator can hide unmarked objects without
+// the barrier seeing it. Weak/soft referents clearing also
+// must happen while mutator can't read those fields. So do
+// the last bits of remark, clear and end marking in one pause
+//
+// Flushing buffers one thread at a time instead isn't enough,
+// thread already flushed may log again while others are being
+// flushed so marking can only end when every buffer is empty
+// at same time. And without read barrier nothing stops mutator
+// from loading referent about to be cleared
+static void remarkPhase(struct cycle_state* state) {
+  pauseAppThreads(state);
+  phaseBegin(state);
+  finalRemarkPhase(state);
+  
+  // Only grows while marking, so now is its peak
+  size_t discoveredCount = state->self->discoveredReferencesCount;
+  state->stats.lastDiscoveredReferencesHighWaterMark = discoveredCount;
+  if (discoveredCount > state->stats.lifetimeDiscoveredReferencesHighWaterMark)
+    state->stats.lifetimeDiscoveredReferencesHighWaterMark = discoveredCount;
+  
+  if (discoveredCount > 0)
+    clearUnmarkedReferents(state);
+  atomic_store_explicit(&state->self->markingInProgress, false, memory_order_release);
+  phaseEnd(state, GC_PHASE_REMARK);
+  unpauseAppThreads(state);
+  
+  // Write heavy cycle may left lots of empty buffers
+  remark_buffer_pool_trim(state->self->remarkBufferPool, GC_REMARK_BUFFER_POOL_KEEP_COUNT);
+}
+
 // Returns bytes free'd
 static size_t sweepPhase(struct cycle_state* state) {
   __block uint64_t count = 0;
@@ -319,20 +475,44 @@ static size_t sweepPhase(struct cycle_state* state) {
   __block uint64_t liveObjectCount = 0;
   __block size_t liveObjectSize = 0;
   
-  alloc_tracker_filter_snapshot_and_delete_snapshot(state->arena, &state->objectsListSnapshot, ^bool (struct alloc_unit* block) {
+  struct gc_census* census = state->census;
+  struct alloc_profiler* profiler = state->self->allocProfiler;
+  
+  // Two separate filters so sweeping without census
+  // don't pay for it
+  alloc_tracker_snapshot_filter_func filter = ^bool (struct alloc_unit* block) {
+    size_t size = alloc_unit_get_size(block);
     count++;
-    totalSize += block->size;
+    totalSize += size;
     // Object is alive continuing
-    if (atomic_load_explicit(&block->gcMetadata.markBit, memory_order_relaxed) == state->self->GCMarkedBitValue) {
+    if (alloc_unit_load_mark_bit(block) == getGCMarkedBitValue(state->self)) {
       liveObjectCount++;
-      liveObjectSize += block->size;
+      liveObjectSize += size;
       return true;
     }
     
+    if (profiler && alloc_unit_is_sampled(block))
+      alloc_profiler_record_death(profiler, block);
+    
     sweepedCount++;
-    sweepSize += block->size;
+    sweepSize += size;
     return false;
-  });
+  };
+  
+  alloc_tracker_snapshot_filter_func censusFilter = ^bool (struct alloc_unit* block) {
+    struct descriptor* desc = alloc_unit_get_descriptor(block, memory_order_relaxed);
+    size_t size = alloc_unit_get_size(block);
+    if (filter(block)) {
+      gc_census_record_live(census, desc, size);
+      return true;
+    }
+    
+    gc_census_record_sweeped(census, desc, size);
+    return false;
+  };
+  
+  alloc_tracker_filter_snapshot_and_delete_snapshot(state->arena, &state->objectsListSnapshot, census ? censusFilter : filter);
+  state->sweepedThroughSize = totalSize;
   
   state->stats.lifetimeTotalSweepedObjectCount += sweepedCount;
   state->stats.lifetimeTotalSweepedObjectSize += sweepSize;
@@ -347,6 +527,12 @@ static size_t sweepPhase(struct cycle_state* state) {
 }
 
 static void pauseAppThreads(struct cycle_state* state) {
+  // Boost before waiting for mutators, as mutators
+  // are blocked while GC waits the rest
+  struct gc_options* options = &state->self->runtime->options;
+  if (options->boostPauses)
+    platform_set_current_thread_sched(PLATFORM_SCHED_NORMAL, options->pauseNice);
+  
   gc_lock_enter_gc_exclusive(state->self->gcLock);
   clock_gettime(CLOCK_REALTIME, &state->pauseBegin);
 }
@@ -355,47 +541,128 @@ static void unpauseAppThreads(struct cycle_state* state) {
   clock_gettime(CLOCK_REALTIME, &state->pauseEnd);
   gc_lock_exit_gc_exclusive(state->self->gcLock);
   
+  struct gc_options* options = &state->self->runtime->options;
+  if (options->boostPauses)
+    platform_set_current_thread_sched(options->concurrentSchedPolicy, options->concurrentNice);
+  
   double duration = 
     ((double) state->pauseEnd.tv_sec + ((double) state->pauseEnd.tv_nsec/ 1'000'000'000.0f)) -
     ((double) state->pauseBegin.tv_sec + ((double) state->pauseBegin.tv_nsec/ 1'000'000'000.0f));
   state->stats.lifetimeSTWTime += duration;
 }
 
-static void cycleRunner(struct gc_per_generation_state* self) {
+static struct gc_census* prepareCensus(struct gc_per_generation_state* self) {
+  if (!self->workingCensus && !(self->workingCensus = gc_census_new())) {
+    pr_error("Cannot allocate heap census, skipping census for this cycle");
+    return NULL;
+  }
+  
+  gc_census_reset(self->workingCensus);
+  return self->workingCensus;
+}
+
+static void publishCensus(struct gc_per_generation_state* self, struct gc_census* census, uint64_t cycleID) {
+  census->cycleID = cycleID;
+  
+  flup_mutex_lock(self->censusLock);
+  self->workingCensus = self->lastCensus;
+  self->lastCensus = census;
+  flup_mutex_unlock(self->censusLock);
+}
+
+// Readers copy "stats" and retry if sequence changed meanwhile
+static void publishStats(struct gc_per_generation_state* self, const struct gc_stats* stats) {
+  unsigned int sequence = atomic_load_explicit(&self->statsSequence, memory_order_relaxed);
+  atomic_store_explicit(&self->statsSequence, sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  self->stats = *stats;
+  atomic_store_explicit(&self->statsSequence, sequence + 2, memory_order_release);
+}
+
+static void updateRateStats(struct cycle_state* state, struct mark_stack* markStack) {
+  struct gc_stats* stats = &state->stats;
+  stats->lifetimeTracedObjectCount += state->tracedObjectCount;
+  stats->lifetimeTracedObjectSize += state->tracedObjectSize;
+  
+  double markTime = stats->phases[GC_PHASE_MARK].lastWallTime + stats->phases[GC_PHASE_REMARK].lastWallTime;
+  double sweepTime = stats->phases[GC_PHASE_SWEEP].lastWallTime;
+  stats->lastMarkRate = markTime > 0.0 ? (double) state->tracedObjectSize / markTime : 0.0;
+  stats->lastSweepRate = sweepTime > 0.0 ? (double) state->sweepedThroughSize / sweepTime : 0.0;
+  
+  stats->lastMarkStackHighWaterMark = markStack->peakSegmentCount * GC_MARK_STACK_SEGMENT_ENTRIES;
+  if (stats->lastMarkStackHighWaterMark > stats->lifetimeMarkStackHighWaterMark)
+    stats->lifetimeMarkStackHighWaterMark = stats->lastMarkStackHighWaterMark;
+}
+
+void gc_run_cycle(struct gc_per_generation_state* self, struct mark_stack* markStack) {
   struct cycle_state state = {
     .arena = self->ownerGen->allocTracker,
     .self = self,
+    .markStack = markStack,
     .heap = self->ownerGen->ownerHeap
   };
   
-  // pr_info("Before cycle mem usage: %f MiB", (float) atomic_load(&state.arena->currentUsage) / 1024.0f / 1024.0f);
-  flup_mutex_lock(self->statsLock);
-  self->stats.lifetimeCyclesStartCount++;
+  // pr_info("Before cycle mem usage: %f MiB", (float) alloc_tracker_get_usage(state.arena) / 1024.0f / 1024.0f);
+  // This thread is the only writer so no need for
+  // seqlock to read it
   state.stats = self->stats;
+  state.stats.lifetimeCyclesStartCount++;
+  publishStats(self, &state.stats);
   size_t prev = state.stats.lifetimeLiveObjectSize;
-  flup_mutex_unlock(self->statsLock);
+  markStack->peakSegmentCount = markStack->segmentCount;
   
   struct timespec start, end;
   clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
   
   pauseAppThreads(&state);
-  self->mutatorMarkedBitValue = self->GCMarkedBitValue;
+  phaseBegin(&state);
+  self->mutatorMarkedBitValue = getGCMarkedBitValue(self);
   atomic_store_explicit(&self->cycleInProgress, true, memory_order_release);
   
   atomic_store_explicit(&self->markingInProgress, true, memory_order_release);
+  self->clearSoftReferences = atomic_exchange_explicit(&self->softReferencePressure, false, memory_order_relaxed);
   takeRootSnapshotPhase(&state);
   alloc_tracker_take_snapshot(state.arena, &state.objectsListSnapshot);
+  
+  // Recycled lists are owner only, except in pause
+  bool trimming = atomic_exchange_explicit(&self->trimRequested, false, memory_order_relaxed);
+  if (trimming)
+    alloc_tracker_free_recycled(state.arena);
+  phaseEnd(&state, GC_PHASE_ROOT_SNAPSHOT);
   unpauseAppThreads(&state);
   
+  phaseBegin(&state);
   markingPhase(&state);
-  atomic_store_explicit(&self->markingInProgress, false, memory_order_release);
-  processMutatorMarkQueuePhase(&state);
-  size_t freedBytes = sweepPhase(&state);
+  phaseEnd(&state, GC_PHASE_MARK);
+  remarkPhase(&state);
   
-  pauseAppThreads(&state);
-  self->GCMarkedBitValue = !self->GCMarkedBitValue;
+  phaseBegin(&state);
+  if (atomic_load_explicit(&self->censusEnabled, memory_order_relaxed))
+    state.census = prepareCensus(self);
+  size_t freedBytes = sweepPhase(&state);
+  if (state.census)
+    publishCensus(self, state.census, self->cycleID + 1);
+  if (self->allocProfiler)
+    alloc_profiler_end_cycle(self->allocProfiler);
+  phaseEnd(&state, GC_PHASE_SWEEP);
+  
+  updateRateStats(&state, markStack);
+  
+  // No pause needed, mutators only read GC's value in barrier
+  // while marking and their value for new objects stays until
+  // next cycle's pause. So marked survivors just become white.
+  // Cycle still has two pauses, root snapshot and remark
+  // (see remarkPhase for why it can't be a handshake)
+  atomic_store_explicit(&self->GCMarkedBitValue, !getGCMarkedBitValue(self), memory_order_relaxed);
   atomic_store_explicit(&self->cycleInProgress, false, memory_order_release);
-  unpauseAppThreads(&state);
+  
+  // After sweeping so blocks it just freed are included
+  if (trimming)
+    alloc_tracker_trim(state.arena);
+  
+  // Remark buffers of detached threads were processed
+  // so nothing needs them anymore
+  heap_reap_detached_threads(state.heap);
   clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
   
   flup_mutex_lock(self->cycleStatusLock);
@@ -410,11 +677,9 @@ static void cycleRunner(struct gc_per_generation_state* self) {
   state.stats.lifetimeCycleTime += duration;
   state.stats.lifetimeCyclesCompletedCount++;
   
-  flup_mutex_lock(self->statsLock);
-  self->stats = state.stats;
-  flup_mutex_unlock(self->statsLock);
+  publishStats(self, &state.stats);
   
-  size_t usage = atomic_load_explicit(&self->ownerGen->allocTracker->currentUsage, memory_order_relaxed);
+  size_t usage = alloc_tracker_get_usage(self->ownerGen->allocTracker);
   atomic_store_explicit(&self->bytesUsedRightBeforeSweeping, usage + freedBytes, memory_order_relaxed);
   atomic_store_explicit(&self->liveSetSize, state.stats.lifetimeLiveObjectSize - prev, memory_order_relaxed);
   moving_window_append(self->cycleTimeSamples, &duration);
@@ -425,34 +690,7 @@ static void cycleRunner(struct gc_per_generation_state* self) {
     total += *((double*) iterator.current);
   
   atomic_store_explicit(&self->averageCycleTime, total / (double) self->cycleTimeSamples->entryCount, memory_order_relaxed);
-  // pr_info("After cycle mem usage: %f MiB", (float) atomic_load(&state.arena->currentUsage) / 1024.0f / 1024.0f);
-}
-
-static void gcThread(void* _self) {
-  struct gc_per_generation_state* self = _self;
-  
-  pr_info("GC thread started!");
-  while (1) {
-    flup_mutex_lock(self->gcRequestLock);
-    while (self->gcRequest == GC_NOOP)
-      flup_cond_wait(self->gcRequestedCond, self->gcRequestLock, NULL);
-    enum gc_request request = self->gcRequest;
-    self->gcRequest = GC_NOOP;
-    flup_mutex_unlock(self->gcRequestLock);
-    
-    switch (request) {
-      case GC_NOOP:
-        flup_panic("Unreachable");
-      case GC_SHUTDOWN:
-        pr_info("Shutting down GC thread");
-        goto shutdown_gc_thread;
-      case GC_START_CYCLE:
-        // pr_info("Starting GC cycle!");
-        cycleRunner(self);
-        break;
-    }
-  }
-shutdown_gc_thread:
+  // pr_info("After cycle mem usage: %f MiB", (float) alloc_tracker_get_usage(state.arena) / 1024.0f / 1024.0f);
 }
 
 uint64_t gc_start_cycle_async(struct gc_per_generation_state* self) {
@@ -467,8 +705,8 @@ uint64_t gc_start_cycle_async(struct gc_per_generation_state* self) {
   self->cycleWasInvoked = true;
   flup_mutex_unlock(self->cycleStatusLock);
   
-  // Wake GC thread
-  callGCAsync(self, GC_START_CYCLE);
+  // Let runtime's worker pick it up
+  gc_runtime_request_cycle(self->runtime, self);
 no_need_to_wake_gc:
   return lastCycleID;
 }
@@ -488,6 +726,13 @@ int gc_wait_cycle(struct gc_per_generation_state* self, uint64_t cycleID, struct
   return 0;
 }
 
+bool gc_is_cycle_done(struct gc_per_generation_state* self, uint64_t cycleID) {
+  flup_mutex_lock(self->cycleStatusLock);
+  bool isDone = self->cycleID != cycleID;
+  flup_mutex_unlock(self->cycleStatusLock);
+  return isDone;
+}
+
 void gc_start_cycle(struct gc_per_generation_state* self) {
   gc_wait_cycle(self, gc_start_cycle_async(self), NULL);
 }
@@ -500,10 +745,56 @@ void gc_unblock(struct gc_per_generation_state* self, struct thread* blockingThr
   gc_lock_unblock_gc(self->gcLock, blockingThread->gcLockPerThread);
 }
 
+void gc_enter_native(struct gc_per_generation_state* self, struct thread* thread) {
+  gc_lock_enter_native(self->gcLock, thread->gcLockPerThread);
+}
+
+void gc_exit_native(struct gc_per_generation_state* self, struct thread* thread) {
+  gc_lock_exit_native(self->gcLock, thread->gcLockPerThread);
+}
+
+void gc_safepoint_poll(struct gc_per_generation_state* self, struct thread* thread) {
+  gc_lock_poll(self->gcLock, thread->gcLockPerThread);
+}
+
 void gc_get_stats(struct gc_per_generation_state* self, struct gc_stats* stats) {
-  flup_mutex_lock(self->statsLock);
-  *stats = self->stats;
-  flup_mutex_unlock(self->statsLock);
+  unsigned int sequence;
+  do {
+    while ((sequence = atomic_load_explicit(&self->statsSequence, memory_order_acquire)) & 1)
+      ;
+    *stats = self->stats;
+    atomic_thread_fence(memory_order_acquire);
+  } while (atomic_load_explicit(&self->statsSequence, memory_order_relaxed) != sequence);
+  
+  uint64_t pacingNanosec = atomic_load_explicit(&self->pacingNanosecTotal, memory_order_relaxed);
+  stats->lifetimePacingTime = (double) pacingNanosec / 1'000'000'000.0;
+}
+
+void gc_set_census_enabled(struct gc_per_generation_state* self, bool enabled) {
+  atomic_store_explicit(&self->censusEnabled, enabled, memory_order_relaxed);
+}
+
+struct gc_census* gc_get_census(struct gc_per_generation_state* self) {
+  struct gc_census* copy = NULL;
+  flup_mutex_lock(self->censusLock);
+  if (self->lastCensus)
+    copy = gc_census_copy(self->lastCensus);
+  flup_mutex_unlock(self->censusLock);
+  return copy;
+}
+
+int gc_write_alloc_profile(struct gc_per_generation_state* self, const char* path) {
+  if (!self->allocProfiler)
+    return -EINVAL;
+  return alloc_profiler_write(self->allocProfiler, path);
+}
+
+void gc_notify_memory_pressure(struct gc_per_generation_state* self) {
+  atomic_store_explicit(&self->softReferencePressure, true, memory_order_relaxed);
+}
+
+void gc_request_trim(struct gc_per_generation_state* self) {
+  atomic_store_explicit(&self->trimRequested, true, memory_order_relaxed);
 }
 
 void gc_on_preallocate(struct generation* gen) {
@@ -523,5 +814,7 @@ void gc_on_preallocate(struct generation* gen) {
   while ((err = clock_nanosleep(CLOCK_REALTIME, 0, &sleepTime, &timeLeft)) == EINTR)
     sleepTime = timeLeft;
   BUG_ON(err != 0);
+  
+  atomic_fetch_add_explicit(&gcState->pacingNanosecTotal, pacingNanosec, memory_order_relaxed);
 }
 
@@ -30,17 +30,27 @@ fun startOfGCCycle()
   resume all application threads()
   
   // Phase 2: Do marking (can be concurrent)
+  // Completed mutator mark queue chunks are drained
+  // along the way
   for obj in rootSnapshot do
     obj.markRecursively()
+    drain completed chunks of mutatorMarkQueue()
   end
   
-  // Phase 3: Process mutator mark queue (can be concurrent)
+  // Phase 3: Process rest of mutator mark queue (STW)
   // Application still can queue new thing to mark
   // covering case of mutator losing reference in such a way
-  // live object did not get marked properly
+  // live object did not get marked properly. Marking only
+  // ends after the queue is empty so this part done while
+  // application threads stopped. Per thread handshake can't
+  // replace it as queue must be empty for every thread at
+  // once and weak referents are cleared here too
+  stop all application threads()
   for obj in mutatorMarkQueue do
     obj.markRecursively()
   end
+  end marking()
+  resume all application threads()
   
   // Phase 4: Sweeping phase (can be concurrent)
   // After scanning the GC root white objects guarantee
@@ -50,13 +60,12 @@ fun startOfGCCycle()
   free all unmarked objects()
   
   // Phase 5: Change meaning of mark bit of GC so marked objects become unmarked
-  // STW to ensure mutator don't read this while cycle is not complete
-  // so it did not and must not create object premarked (as there no cycle
-  // going on)
-  stop all application threads()
+  // No STW needed, mutators only read GC's meaning in the barrier while
+  // marking which already ended and their meaning for new objects only
+  // changes at next cycle's pause, so objects they create from now on are
+  // unmarked in GC's perspective
   flip GC's meaning of the mark bit()
   cycleInProgress = false
-  resume all application threads()
 end
 
 // `obj` is object which was about to be overwritten
@@ -84,37 +93,64 @@ Extra notes:
 #include <stdint.h>
 #include <stddef.h>
 
-#include <flup/data_structs/buffer/circular_buffer.h>
 #include <flup/concurrency/cond.h>
 #include <flup/concurrency/mutex.h>
 #include <flup/data_structs/dyn_array.h>
-#include <flup/data_structs/buffer.h>
+#include <flup/data_structs/list_head.h>
 #include <flup/thread/thread.h>
 #include <time.h>
 
-// 32 MiB mutator mark queue size
-#define GC_MUTATOR_MARK_QUEUE_SIZE (32 * 1024 * 1024)
-// 16 MiB mark queue for GC only
-#define GC_MARK_QUEUE_SIZE (16 * 1024 * 1024)
-// 16 MiB deferred mark queue for when objects can't fit into one mark queue
-#define GC_DEFERRED_MARK_QUEUE_SIZE (16 * 1024 * 1024)
+#include "platform/platform.h"
+
 
 #define GC_CYCLE_TIME_SAMPLE_COUNT (5)
 
+// Pull mutator's completed remark buffers every N roots marked
+#define GC_REMARK_DRAIN_INTERVAL (64)
+// Maximum rounds of draining after roots marked before
+// going into final remark pause
+#define GC_REMARK_DRAIN_MAX_ROUNDS (8)
+
+// Initial capacity of list of objects with weak/soft
+// fields found during marking
+#define GC_DISCOVERED_REFERENCES_INITIAL_CAPACITY (1024)
+
 struct generation;
 struct alloc_unit;
 struct thread;
+struct gc_census;
+struct alloc_profiler;
+struct remark_buffer_pool;
+struct gc_runtime;
+struct mark_stack;
 
 struct gc_block_metadata {
   struct generation* owningGeneration;
   // Meaning changes based on flipColor on per generation state
   atomic_bool markBit;
+  // Tracked by allocation profiler, fits in padding
+  atomic_bool sampled;
+};
+
+enum gc_phase {
+  // Taking snapshot of root set and list of objects in the pause
+  GC_PHASE_ROOT_SNAPSHOT,
+  // Concurrent marking including remark buffers drained along
+  GC_PHASE_MARK,
+  // Final remark and clearing weak/soft references in the pause
+  GC_PHASE_REMARK,
+  GC_PHASE_SWEEP,
+  
+  GC_PHASE_COUNT
 };
 
-enum gc_request {
-  GC_NOOP,
-  GC_START_CYCLE,
-  GC_SHUTDOWN
+// Times in seconds, CPU time is of the GC thread only
+// so its less than wall time if GC got preempted
+struct gc_phase_stats {
+  double lifetimeWallTime;
+  double lifetimeCPUTime;
+  double lastWallTime;
+  double lastCPUTime;
 };
 
 struct gc_stats {
@@ -136,28 +172,128 @@ struct gc_stats {
   
   double lifetimeCycleTime;
   double lifetimeSTWTime;
+  
+  struct gc_phase_stats phases[GC_PHASE_COUNT];
+  
+  // Objects which GC traced through (newly marked by GC
+  // itself, not ones allocated marked)
+  uint64_t lifetimeTracedObjectCount;
+  size_t lifetimeTracedObjectSize;
+  
+  // Bytes per second of wall time, marking rate is over
+  // mark and remark phase. Sweeping rate counts every
+  // objects in the snapshot, dead or alive
+  double lastMarkRate;
+  double lastSweepRate;
+  
+  // Peak mark stack usage in entries, rounded up to
+  // whole mark stack segment
+  size_t lastMarkStackHighWaterMark;
+  size_t lifetimeMarkStackHighWaterMark;
+  
+  // Peak count of objects with weak/soft fields whose
+  // processing deferred until marking done
+  size_t lastDiscoveredReferencesHighWaterMark;
+  size_t lifetimeDiscoveredReferencesHighWaterMark;
+  
+  // Full remark buffers handed over by mutators and
+  // partially filled ones processed in remark pause
+  uint64_t lifetimeRemarkBufferCount;
+  uint64_t lifetimeFinalRemarkBufferCount;
+  
+  // Total seconds mutators slept in pacing, summed over
+  // every threads
+  double lifetimePacingTime;
 };
 
-struct gc_mark_state {
-  struct alloc_unit* block;
-  size_t fieldIndex;
+#define GC_OPTIONS_NUMA_NODE_NONE (-1)
+// Use NUMA node which backs start of the heap
+#define GC_OPTIONS_NUMA_NODE_AUTO (-2)
+
+// Placement and scheduling of GC's threads (workers and
+// scheduler of the runtime), every failures are just warned
+// because GC still works fine without these
+struct gc_options {
+  // Runtime which runs this heap's cycles (see gc/runtime.h),
+  // must outlive the heap. NULL to create private one using
+  // the rest of these options. Placement and scheduling
+  // options are ignored when runtime given as those belong
+  // to the runtime
+  struct gc_runtime* runtime;
+  
+  // CPUs in Linux's cpulist format ("0-3,8"), NULL
+  // for no restriction, takes priority over numaNode
+  const char* cpuList;
+  
+  // Run on CPUs of this NUMA node, GC_OPTIONS_NUMA_NODE_NONE
+  // or GC_OPTIONS_NUMA_NODE_AUTO
+  int numaNode;
+  
+  // Scheduling while GC running concurrently with mutators
+  enum platform_sched_policy concurrentSchedPolicy;
+  int concurrentNice;
+  
+  // Give GC thread higher priority during stop the world
+  // pauses, lowering nice may need CAP_SYS_NICE
+  bool boostPauses;
+  int pauseNice;
+  
+  // Fraction of CPU time GC should use (0.0 - 1.0), when set
+  // the driver triggers cycles so that GC's CPU usage stays
+  // around this trading memory for throughput, instead of
+  // triggering early to keep heap usage low. 0 to disable
+  double targetCPUFraction;
+  
+  // Mean bytes between allocations sampled by allocation
+  // profiler (see gc/alloc_profiler.h), 0 to disable
+  size_t allocProfilerSampleInterval;
 };
 
+#define GC_OPTIONS_DEFAULT ((struct gc_options) { \
+  .runtime = NULL, \
+  .cpuList = NULL, \
+  .numaNode = GC_OPTIONS_NUMA_NODE_NONE, \
+  .concurrentSchedPolicy = PLATFORM_SCHED_NORMAL, \
+  .concurrentNice = 0, \
+  .boostPauses = false, \
+  .pauseNice = 0, \
+  .targetCPUFraction = 0.0, \
+  .allocProfilerSampleInterval = 0 \
+})
+
 struct gc_per_generation_state {
-  flup_mutex* statsLock;
+  // Seqlock for "stats", odd while GC updating it. Only
+  // GC thread running the cycle writes so readers never
+  // block it
+  atomic_uint statsSequence;
   struct gc_stats stats;
   
+  // Kept separately as mutators add to it
+  atomic_uint_least64_t pacingNanosecTotal;
+  
   atomic_size_t bytesUsedRightBeforeSweeping;
   atomic_size_t liveSetSize;
   
   struct generation* ownerGen;
   struct gc_lock_state* gcLock;
   
-  flup_thread* thread;
+  // "cpuList" and "runtime" are not used from here,
+  // the runtime has its own copy
+  struct gc_options options;
+  
+  // Runtime running cycles for this generation, owned
+  // if it was created privately for this generation
+  struct gc_runtime* runtime;
+  bool ownsRuntime;
+  
+  // Protected by runtime's heapsLock
+  flup_list_head runtimeNode;
   
-  enum gc_request gcRequest;
-  flup_mutex* gcRequestLock;
-  flup_cond* gcRequestedCond;
+  // These protected by runtime's lock
+  flup_list_head runtimePendingNode;
+  bool cycleQueued;
+  bool cycleRunning;
+  bool cycleRequestedAgain;
   
   bool cycleWasInvoked;
   uint64_t cycleID;
@@ -166,24 +302,38 @@ struct gc_per_generation_state {
   
   // What mark bit value correspond to marked (
   // the meaning of the mark bit changes throughout
-  // lifetime) protected by STW events
+  // lifetime). Mutator's one protected by STW events,
+  // GC's one only written by GC and flipped without
+  // pause at end of cycle
   bool mutatorMarkedBitValue;
-  bool GCMarkedBitValue;
+  atomic_bool GCMarkedBitValue;
   atomic_bool cycleInProgress;
   atomic_bool markingInProgress;
   
-  flup_buffer* needRemarkQueue;
+  // Pool of SATB remark buffers which mutators fill
+  // and hand over to GC
+  struct remark_buffer_pool* remarkBufferPool;
   
   size_t snapshotOfRootSetSize;
+  size_t snapshotOfRootSetCapacity;
   struct alloc_unit** snapshotOfRootSet;
   
-  flup_circular_buffer* gcMarkQueueUwU;
+  // Objects which has weak/soft fields which were
+  // not traced through during marking. After marking
+  // completes, unmarked referents are cleared. Only
+  // touched by GC thread
+  struct alloc_unit** discoveredReferences;
+  size_t discoveredReferencesCount;
+  size_t discoveredReferencesCapacity;
   
-  // For storing objects which cannot be
-  // fully enqueued to the mark queue
-  // so save it for later after mark queue
-  // is empty
-  flup_circular_buffer* deferredMarkQueue;
+  // Set by driver or allocator when heap under memory
+  // pressure so next cycle clears soft references too
+  atomic_bool softReferencePressure;
+  bool clearSoftReferences;
+  
+  // Set by gc_request_trim, next cycle frees memory
+  // cached by contexts while mutators paused
+  atomic_bool trimRequested;
   
   struct gc_driver* driver;
   
@@ -202,6 +352,19 @@ struct gc_per_generation_state {
   // rate still too high and heap is gonna OOM
   // before cycle completed
   atomic_uint pacingMicrosec;
+  
+  // Per descriptor census of the heap, only collected
+  // when enabled so sweeper don't pay for it otherwise.
+  // Sweeper fills "workingCensus" then swaps it with
+  // "lastCensus" under censusLock
+  atomic_bool censusEnabled;
+  flup_mutex* censusLock;
+  struct gc_census* lastCensus;
+  struct gc_census* workingCensus;
+  
+  // NULL if allocation profiler disabled, sweeper
+  // reports sampled objects which died into it
+  struct alloc_profiler* allocProfiler;
 };
 
 void gc_start_cycle(struct gc_per_generation_state* self);
@@ -214,19 +377,50 @@ uint64_t gc_start_cycle_async(struct gc_per_generation_state* self);
 // or -ETIMEDOUT if `absTimeout` reached and cycle hasnt completed
 int gc_wait_cycle(struct gc_per_generation_state* self, uint64_t cycleID, struct timespec* absTimeout);
 
-struct gc_per_generation_state* gc_per_generation_state_new(struct generation* gen);
+// Non blocking check whether cycle after "cycleID" completed
+bool gc_is_cycle_done(struct gc_per_generation_state* self, uint64_t cycleID);
+
+// Run one cycle on calling thread, used by runtime's workers
+void gc_run_cycle(struct gc_per_generation_state* self, struct mark_stack* markStack);
+
+struct gc_per_generation_state* gc_per_generation_state_new(struct generation* gen, const struct gc_options* options);
 void gc_per_generation_state_free(struct gc_per_generation_state* self);
 
 void gc_on_allocate(struct alloc_unit* block, struct generation* gen);
 void gc_need_remark(struct alloc_unit* obj);
 void gc_on_preallocate(struct generation* gen);
 
+// Let next cycle clear soft references which referent
+// is not strongly reachable
+void gc_notify_memory_pressure(struct gc_per_generation_state* self);
+
+// Let next cycle give memory cached by every thread back to
+// OS, including threads which are idle (see alloc_tracker_trim)
+void gc_request_trim(struct gc_per_generation_state* self);
+
 // These can't be nested
 void gc_block(struct gc_per_generation_state* self, struct thread* blockingThread);
 void gc_unblock(struct gc_per_generation_state* self, struct thread* blockingThread);
 
+// See gc_lock_enter_native and friends in gc/gc_lock.h
+void gc_enter_native(struct gc_per_generation_state* self, struct thread* thread);
+void gc_exit_native(struct gc_per_generation_state* self, struct thread* thread);
+void gc_safepoint_poll(struct gc_per_generation_state* self, struct thread* thread);
+
+// Lock free, may retry if GC is updating stats at the same time
 void gc_get_stats(struct gc_per_generation_state* self, struct gc_stats* stats);
 
+// Census is collected starting on next cycle after enabling
+void gc_set_census_enabled(struct gc_per_generation_state* self, bool enabled);
+
+// Returns copy of census from last cycle which had census enabled
+// or NULL if there none or out of memory. Free it with gc_census_free
+struct gc_census* gc_get_census(struct gc_per_generation_state* self);
+
+// Write allocation profile (see gc/alloc_profiler.h), returns 0
+// or -EINVAL if profiler disabled or -errno if can't be written
+int gc_write_alloc_profile(struct gc_per_generation_state* self, const char* path);
+
 void gc_perform_shutdown(struct gc_per_generation_state* self);
 
 #endif
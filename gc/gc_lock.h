@@ -23,4 +23,15 @@ void gc_lock_exit_gc_exclusive(struct gc_lock_state* self);
 void gc_lock_block_gc(struct gc_lock_state* self, struct gc_lock_per_thread_data* thread);
 void gc_lock_unblock_gc(struct gc_lock_state* self, struct gc_lock_per_thread_data* thread);
 
+// For cooperative safepoint implementation, thread which
+// going to do long operation without touching the heap
+// must enter native state so GC don't wait for it. Polling
+// lets GC stop the thread at points like loop back-edges.
+//
+// Implementations which blocks GC only inside block/unblock
+// pair treat these as no-op
+void gc_lock_enter_native(struct gc_lock_state* self, struct gc_lock_per_thread_data* thread);
+void gc_lock_exit_native(struct gc_lock_state* self, struct gc_lock_per_thread_data* thread);
+void gc_lock_poll(struct gc_lock_state* self, struct gc_lock_per_thread_data* thread);
+
 #endif
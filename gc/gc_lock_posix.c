@@ -46,4 +46,12 @@ void gc_lock_unblock_gc(struct gc_lock_state* self, struct gc_lock_per_thread_da
   flup_rwlock_unlock(INTERN(self));
 }
 
+void gc_lock_enter_native(struct gc_lock_state*, struct gc_lock_per_thread_data*) {
+}
+
+void gc_lock_exit_native(struct gc_lock_state*, struct gc_lock_per_thread_data*) {
+}
+
+void gc_lock_poll(struct gc_lock_state*, struct gc_lock_per_thread_data*) {
+}
 
@@ -0,0 +1,199 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <flup/core/panic.h>
+#include <flup/concurrency/cond.h>
+#include <flup/concurrency/mutex.h>
+#include <flup/data_structs/list_head.h>
+
+#include "gc_lock.h"
+
+// Cooperative safepoint implementation of the GC lock
+//
+// Mutator is "managed" by default which means it may touch
+// the heap any time, so blocking GC only costs polling a flag.
+// GC requests safepoint and waits until every managed mutator
+// parks itself at next poll. Mutator which doing long operation
+// not touching the heap (sleeping, syscalls, waiting on other
+// threads) must enter "native" state so GC don't wait for it
+
+enum mutator_state : uint32_t {
+  // Mutator may access heap any time
+  MUTATOR_MANAGED = 0,
+
+  // Mutator promised not to touch the heap
+  MUTATOR_NATIVE  = 1,
+
+  // Mutator stopped at safepoint, waiting GC
+  MUTATOR_PARKED  = 2
+};
+
+struct gc_lock_per_thread_data {
+  flup_list_head node;
+
+  [[gnu::aligned(64)]]
+  _Atomic(enum mutator_state) mutatorState;
+};
+
+struct gc_lock_state {
+  flup_list_head mutatorThreadsList;
+
+  // Protects the mutatorThreadsList and used for
+  // waiting on slow paths
+  flup_mutex* lock;
+
+  // GC waits on this for mutators to park or become native
+  flup_cond* mutatorStateChangedEvent;
+
+  // Mutators wait on this for GC to release them
+  flup_cond* safepointEndedEvent;
+
+  [[gnu::aligned(64)]]
+  atomic_bool safepointRequested;
+};
+
+struct gc_lock_state* gc_lock_new() {
+  struct gc_lock_state* self = malloc(sizeof(*self));
+  if (!self)
+    return NULL;
+
+  *self = (struct gc_lock_state) {
+    .mutatorThreadsList = FLUP_LIST_HEAD_INIT(self->mutatorThreadsList),
+    .safepointRequested = false
+  };
+
+  if (!(self->lock = flup_mutex_new()))
+    goto failure;
+  if (!(self->mutatorStateChangedEvent = flup_cond_new()))
+    goto failure;
+  if (!(self->safepointEndedEvent = flup_cond_new()))
+    goto failure;
+  return self;
+
+failure:
+  gc_lock_free(self);
+  return NULL;
+}
+
+void gc_lock_free(struct gc_lock_state* self) {
+  if (!self)
+    return;
+
+  if (self->lock) {
+    flup_mutex_lock(self->lock);
+    if (!flup_list_is_empty(&self->mutatorThreadsList))
+      flup_panic("Not all mutator stopped!");
+    flup_mutex_unlock(self->lock);
+  }
+
+  flup_cond_free(self->safepointEndedEvent);
+  flup_cond_free(self->mutatorStateChangedEvent);
+  flup_mutex_free(self->lock);
+  free(self);
+}
+
+struct gc_lock_per_thread_data* gc_lock_new_thread(struct gc_lock_state* self) {
+  struct gc_lock_per_thread_data* thread = malloc(sizeof(*thread));
+  if (!thread)
+    return NULL;
+
+  *thread = (struct gc_lock_per_thread_data) {
+    .mutatorState = MUTATOR_MANAGED
+  };
+
+  // New thread starts as managed so it must not
+  // join in the middle of safepoint
+  flup_mutex_lock(self->lock);
+  while (atomic_load(&self->safepointRequested))
+    flup_cond_wait(self->safepointEndedEvent, self->lock, NULL);
+  flup_list_add_tail(&self->mutatorThreadsList, &thread->node);
+  flup_mutex_unlock(self->lock);
+  return thread;
+}
+
+void gc_lock_free_thread(struct gc_lock_state* self, struct gc_lock_per_thread_data* thread) {
+  flup_mutex_lock(self->lock);
+  flup_list_del(&thread->node);
+  flup_cond_wake_all(self->mutatorStateChangedEvent);
+  flup_mutex_unlock(self->lock);
+  free(thread);
+}
+
+static void parkAtSafepoint(struct gc_lock_state* self, struct gc_lock_per_thread_data* thread) {
+  flup_mutex_lock(self->lock);
+  atomic_store(&thread->mutatorState, MUTATOR_PARKED);
+  flup_cond_wake_all(self->mutatorStateChangedEvent);
+
+  while (atomic_load(&self->safepointRequested))
+    flup_cond_wait(self->safepointEndedEvent, self->lock, NULL);
+
+  atomic_store(&thread->mutatorState, MUTATOR_MANAGED);
+  flup_mutex_unlock(self->lock);
+}
+
+// The operations
+void gc_lock_enter_gc_exclusive(struct gc_lock_state* self) {
+  atomic_store(&self->safepointRequested, true);
+
+  flup_mutex_lock(self->lock);
+  while (1) {
+    bool allStopped = true;
+    flup_list_head* current;
+    flup_list_for_each(&self->mutatorThreadsList, current) {
+      struct gc_lock_per_thread_data* thread = flup_list_entry(current, struct gc_lock_per_thread_data, node);
+      if (atomic_load(&thread->mutatorState) == MUTATOR_MANAGED) {
+        allStopped = false;
+        break;
+      }
+    }
+
+    if (allStopped)
+      break;
+    flup_cond_wait(self->mutatorStateChangedEvent, self->lock, NULL);
+  }
+  flup_mutex_unlock(self->lock);
+}
+
+void gc_lock_exit_gc_exclusive(struct gc_lock_state* self) {
+  flup_mutex_lock(self->lock);
+  atomic_store(&self->safepointRequested, false);
+  flup_cond_wake_all(self->safepointEndedEvent);
+  flup_mutex_unlock(self->lock);
+}
+
+// Managed thread always blocks GC, so only need to poll
+void gc_lock_block_gc(struct gc_lock_state* self, struct gc_lock_per_thread_data* thread) {
+  gc_lock_poll(self, thread);
+}
+
+void gc_lock_unblock_gc(struct gc_lock_state*, struct gc_lock_per_thread_data*) {
+}
+
+void gc_lock_poll(struct gc_lock_state* self, struct gc_lock_per_thread_data* thread) {
+  if (atomic_load_explicit(&self->safepointRequested, memory_order_relaxed))
+    parkAtSafepoint(self, thread);
+}
+
+void gc_lock_enter_native(struct gc_lock_state* self, struct gc_lock_per_thread_data* thread) {
+  // Pairs with GC setting safepointRequested then reading mutator
+  // states, either GC sees us native or we see the request and
+  // wake GC up
+  atomic_store(&thread->mutatorState, MUTATOR_NATIVE);
+  if (!atomic_load(&self->safepointRequested))
+    return;
+
+  flup_mutex_lock(self->lock);
+  flup_cond_wake_all(self->mutatorStateChangedEvent);
+  flup_mutex_unlock(self->lock);
+}
+
+void gc_lock_exit_native(struct gc_lock_state* self, struct gc_lock_per_thread_data* thread) {
+  atomic_store(&thread->mutatorState, MUTATOR_MANAGED);
+
+  // GC might already counted us as stopped, so
+  // wait until it finished
+  if (atomic_load(&self->safepointRequested))
+    parkAtSafepoint(self, thread);
+}
+
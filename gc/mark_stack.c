@@ -0,0 +1,69 @@
+#include <stdlib.h>
+#include <stddef.h>
+
+#include <flup/bug.h>
+#include <flup/core/panic.h>
+
+#include "mark_stack.h"
+
+void mark_stack_init(struct mark_stack* self) {
+  *self = (struct mark_stack) {};
+}
+
+static void freeSegments(struct mark_stack_segment* segment) {
+  while (segment) {
+    struct mark_stack_segment* prev = segment->prev;
+    free(segment);
+    segment = prev;
+  }
+}
+
+void mark_stack_cleanup(struct mark_stack* self) {
+  freeSegments(self->current);
+  free(self->spare);
+  *self = (struct mark_stack) {};
+}
+
+void mark_stack_trim(struct mark_stack* self) {
+  BUG_ON(self->top != self->base);
+  mark_stack_cleanup(self);
+}
+
+static void useSegment(struct mark_stack* self, struct mark_stack_segment* segment) {
+  self->current = segment;
+  self->base = segment->entries;
+  self->limit = segment->entries + GC_MARK_STACK_SEGMENT_ENTRIES;
+}
+
+void mark_stack_grow(struct mark_stack* self) {
+  struct mark_stack_segment* segment = self->spare;
+  self->spare = NULL;
+
+  if (!segment && !(segment = malloc(sizeof(*segment))))
+    flup_panic("Error reserving memory for GC mark stack (%zu segments already in use)", self->segmentCount);
+
+  segment->prev = self->current;
+  self->segmentCount++;
+  if (self->segmentCount > self->peakSegmentCount)
+    self->peakSegmentCount = self->segmentCount;
+
+  useSegment(self, segment);
+  self->top = self->base;
+}
+
+bool mark_stack_shrink(struct mark_stack* self) {
+  if (!self->current || !self->current->prev)
+    return false;
+
+  struct mark_stack_segment* emptied = self->current;
+  free(self->spare);
+  self->spare = emptied;
+  self->segmentCount--;
+
+  // Previous segment always full as new segment
+  // only added when current one is full
+  useSegment(self, emptied->prev);
+  self->top = self->limit;
+  return true;
+}
+
@@ -0,0 +1,69 @@
+#ifndef UWU_3B9F0D2E_71C4_4E8A_9A56_D0E2C5B81F47_UWU
+#define UWU_3B9F0D2E_71C4_4E8A_9A56_D0E2C5B81F47_UWU
+
+#include <stddef.h>
+
+// Mark stack made from linked fixed size segments, grows and
+// shrinks as needed so there no fixed size limit and no memory
+// used while GC idling. Each marking thread owns one so push and
+// pop are just pointer bumps on the top segment
+
+// 64 KiB per segment including the header
+#define GC_MARK_STACK_SEGMENT_SIZE (64 * 1024)
+#define GC_MARK_STACK_SEGMENT_ENTRIES ((GC_MARK_STACK_SEGMENT_SIZE / sizeof(void*)) - 1)
+
+struct alloc_unit;
+
+struct mark_stack_segment {
+  struct mark_stack_segment* prev;
+  struct alloc_unit* entries[GC_MARK_STACK_SEGMENT_ENTRIES];
+};
+
+struct mark_stack {
+  // Pointers into current (top) segment
+  struct alloc_unit** top;
+  struct alloc_unit** base;
+  struct alloc_unit** limit;
+
+  struct mark_stack_segment* current;
+
+  // Keep one empty segment around so pushing and
+  // popping around segment boundary don't repeatedly
+  // malloc and free
+  struct mark_stack_segment* spare;
+
+  size_t segmentCount;
+  
+  // Most segments used since last reset by owner
+  size_t peakSegmentCount;
+};
+
+void mark_stack_init(struct mark_stack* self);
+void mark_stack_cleanup(struct mark_stack* self);
+
+// Free every unused segments, stack must be empty
+void mark_stack_trim(struct mark_stack* self);
+
+// Slow paths, don't call directly
+void mark_stack_grow(struct mark_stack* self);
+bool mark_stack_shrink(struct mark_stack* self);
+
+static inline void mark_stack_push(struct mark_stack* self, struct alloc_unit* obj) {
+  if (self->top == self->limit)
+    mark_stack_grow(self);
+
+  *self->top = obj;
+  self->top++;
+}
+
+// Return NULL if stack is empty
+static inline struct alloc_unit* mark_stack_pop(struct mark_stack* self) {
+  if (self->top == self->base && !mark_stack_shrink(self))
+    return NULL;
+
+  self->top--;
+  return *self->top;
+}
+
+#endif
+
@@ -0,0 +1,87 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+#include <flup/concurrency/mutex.h>
+
+#include "remark_buffer.h"
+
+struct remark_buffer_pool* remark_buffer_pool_new() {
+  struct remark_buffer_pool* self = malloc(sizeof(*self));
+  if (!self)
+    return NULL;
+
+  *self = (struct remark_buffer_pool) {};
+  if (!(self->freeListPopLock = flup_mutex_new())) {
+    free(self);
+    return NULL;
+  }
+  return self;
+}
+
+static void freeList(struct remark_buffer* current) {
+  while (current) {
+    struct remark_buffer* next = current->next;
+    free(current);
+    current = next;
+  }
+}
+
+void remark_buffer_pool_free(struct remark_buffer_pool* self) {
+  if (!self)
+    return;
+
+  freeList(atomic_load(&self->completedList));
+  freeList(atomic_load(&self->freeList));
+  flup_mutex_free(self->freeListPopLock);
+  free(self);
+}
+
+static void pushToList(_Atomic(struct remark_buffer*)* list, struct remark_buffer* buffer) {
+  struct remark_buffer* oldHead = atomic_load_explicit(list, memory_order_relaxed);
+  do {
+    buffer->next = oldHead;
+  } while (!atomic_compare_exchange_weak_explicit(list, &oldHead, buffer, memory_order_release, memory_order_relaxed));
+}
+
+struct remark_buffer* remark_buffer_pool_get(struct remark_buffer_pool* self) {
+  flup_mutex_lock(self->freeListPopLock);
+  struct remark_buffer* buffer = atomic_load_explicit(&self->freeList, memory_order_acquire);
+  while (buffer && !atomic_compare_exchange_weak_explicit(&self->freeList, &buffer, buffer->next, memory_order_acquire, memory_order_acquire))
+    ;
+  flup_mutex_unlock(self->freeListPopLock);
+
+  if (!buffer && !(buffer = malloc(sizeof(*buffer))))
+    return NULL;
+
+  buffer->next = NULL;
+  buffer->usage = 0;
+  return buffer;
+}
+
+void remark_buffer_pool_put(struct remark_buffer_pool* self, struct remark_buffer* buffer) {
+  pushToList(&self->freeList, buffer);
+}
+
+void remark_buffer_pool_submit(struct remark_buffer_pool* self, struct remark_buffer* buffer) {
+  pushToList(&self->completedList, buffer);
+}
+
+struct remark_buffer* remark_buffer_pool_take_completed(struct remark_buffer_pool* self) {
+  return atomic_exchange_explicit(&self->completedList, NULL, memory_order_acquire);
+}
+
+void remark_buffer_pool_trim(struct remark_buffer_pool* self, unsigned int keepCount) {
+  flup_mutex_lock(self->freeListPopLock);
+  struct remark_buffer* current = atomic_exchange_explicit(&self->freeList, NULL, memory_order_acquire);
+  flup_mutex_unlock(self->freeListPopLock);
+
+  for (unsigned int i = 0; i < keepCount && current; i++) {
+    struct remark_buffer* next = current->next;
+    pushToList(&self->freeList, current);
+    current = next;
+  }
+
+  freeList(current);
+}
+
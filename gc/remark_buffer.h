@@ -0,0 +1,58 @@
+#ifndef UWU_9D4A27C1_5E08_4B3F_8C6D_A1F3E07B2954_UWU
+#define UWU_9D4A27C1_5E08_4B3F_8C6D_A1F3E07B2954_UWU
+
+#include <stdatomic.h>
+
+#include <flup/concurrency/mutex.h>
+
+// Pooled SATB remark buffers. Mutator fills its own buffer
+// and once full, hands the buffer over to GC by pushing
+// it onto completed list (no copying) then takes an
+// empty one from the pool
+
+// 16 KiB per buffer including the header
+#define GC_REMARK_BUFFER_SIZE (16 * 1024)
+#define GC_REMARK_BUFFER_ENTRIES ((GC_REMARK_BUFFER_SIZE - sizeof(void*) * 2) / sizeof(void*))
+
+// Number of empty buffers kept in the pool after each cycle
+#define GC_REMARK_BUFFER_POOL_KEEP_COUNT 64
+
+struct alloc_unit;
+
+struct remark_buffer {
+  struct remark_buffer* next;
+  size_t usage;
+  struct alloc_unit* entries[GC_REMARK_BUFFER_ENTRIES];
+};
+
+struct remark_buffer_pool {
+  // Full buffers waiting to be processed, pushed
+  // lock free and GC takes whole list at once
+  _Atomic(struct remark_buffer*) completedList;
+
+  // Empty buffers, pushed lock free but popping
+  // serialized by the lock so there no ABA problem
+  _Atomic(struct remark_buffer*) freeList;
+  flup_mutex* freeListPopLock;
+};
+
+struct remark_buffer_pool* remark_buffer_pool_new();
+void remark_buffer_pool_free(struct remark_buffer_pool* self);
+
+// Get empty buffer from pool or allocate new one, NULL if out of memory
+struct remark_buffer* remark_buffer_pool_get(struct remark_buffer_pool* self);
+
+// Return buffer into the pool
+void remark_buffer_pool_put(struct remark_buffer_pool* self, struct remark_buffer* buffer);
+
+// Hand buffer over to GC
+void remark_buffer_pool_submit(struct remark_buffer_pool* self, struct remark_buffer* buffer);
+
+// Take every buffers submitted so far, linked by "next"
+struct remark_buffer* remark_buffer_pool_take_completed(struct remark_buffer_pool* self);
+
+// Free empty buffers leaving at most "keepCount" in pool
+void remark_buffer_pool_trim(struct remark_buffer_pool* self, unsigned int keepCount);
+
+#endif
+
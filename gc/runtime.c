@@ -0,0 +1,275 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <flup/concurrency/cond.h>
+#include <flup/concurrency/mutex.h>
+#include <flup/data_structs/list_head.h>
+#include <flup/core/logger.h>
+#include <flup/core/panic.h>
+#include <flup/thread/thread.h>
+
+#include "gc/driver.h"
+#include "gc/gc.h"
+#include "gc/mark_stack.h"
+#include "gc/stat_collector.h"
+#include "platform/platform.h"
+
+#include "runtime.h"
+
+#undef FLUP_LOG_CATEGORY
+#define FLUP_LOG_CATEGORY "GC/Runtime"
+
+// Turn NUMA node into CPU list so runtime's threads only
+// need to set affinity
+static char* resolveCpuList(const struct gc_options* options, void* memoryHint) {
+  if (options->cpuList)
+    return strdup(options->cpuList);
+  if (options->numaNode == GC_OPTIONS_NUMA_NODE_NONE)
+    return NULL;
+
+  int node = options->numaNode;
+  if (node == GC_OPTIONS_NUMA_NODE_AUTO) {
+    if (!memoryHint || (node = platform_get_numa_node_of_address(memoryHint)) < 0) {
+      pr_warn("Cannot determine NUMA node of the heap, GC threads won't be placed");
+      return NULL;
+    }
+  }
+
+  char cpuList[1024];
+  int ret = platform_get_numa_node_cpu_list(node, cpuList, sizeof(cpuList));
+  if (ret < 0) {
+    pr_warn("Cannot get CPUs of NUMA node %d: %d, GC threads won't be placed", node, ret);
+    return NULL;
+  }
+
+  pr_info("GC threads placed on NUMA node %d (CPUs %s)", node, cpuList);
+  return strdup(cpuList);
+}
+
+static void workerThread(void* _self) {
+  struct gc_runtime_worker* self = _self;
+  struct gc_runtime* runtime = self->runtime;
+  gc_runtime_setup_current_thread(runtime);
+
+  pr_info("GC worker started!");
+  flup_mutex_lock(runtime->lock);
+  while (1) {
+    while (!runtime->quitRequested && flup_list_is_empty(&runtime->pendingCycles))
+      flup_cond_wait(runtime->cycleRequestedEvent, runtime->lock, NULL);
+    if (runtime->quitRequested)
+      break;
+
+    struct gc_per_generation_state* gcState = flup_list_first_entry(&runtime->pendingCycles, struct gc_per_generation_state, runtimePendingNode);
+    flup_list_del(&gcState->runtimePendingNode);
+    gcState->cycleQueued = false;
+    gcState->cycleRunning = true;
+    flup_mutex_unlock(runtime->lock);
+
+    gc_run_cycle(gcState, &self->markStack);
+
+    // Give back the mark stack memory while idling
+    mark_stack_trim(&self->markStack);
+
+    flup_mutex_lock(runtime->lock);
+    gcState->cycleRunning = false;
+    if (gcState->cycleRequestedAgain) {
+      gcState->cycleRequestedAgain = false;
+      gcState->cycleQueued = true;
+      flup_list_add_tail(&runtime->pendingCycles, &gcState->runtimePendingNode);
+    }
+    flup_cond_wake_all(runtime->cycleFinishedEvent);
+  }
+  flup_mutex_unlock(runtime->lock);
+  pr_info("Quit requested, quiting");
+}
+
+// Single thread drives every heaps, the stat collectors sampled
+// on every tick and drivers on every few ticks. Drivers never
+// block so one slow heap does not delay the others
+static void schedulerThread(void* _self) {
+  struct gc_runtime* self = _self;
+  gc_runtime_setup_current_thread(self);
+
+  pr_info("GC scheduler started!");
+  struct timespec deadline;
+  if (clock_gettime(CLOCK_REALTIME, &deadline) != 0)
+    flup_panic("Strange this implementation did not support CLOCK_REALTIME");
+
+  unsigned int tick = 0;
+  while (!atomic_load(&self->schedulerQuitRequested)) {
+    bool pollDrivers = tick % (STAT_COLLECTOR_HZ / DRIVER_CHECK_RATE_HZ) == 0;
+
+    flup_mutex_lock(self->heapsLock);
+    flup_list_head* current;
+    flup_list_for_each(&self->heaps, current) {
+      struct gc_per_generation_state* gcState = flup_list_entry(current, struct gc_per_generation_state, runtimeNode);
+      stat_collector_poll(gcState->driver->statCollector);
+      if (pollDrivers)
+        gc_driver_poll(gcState->driver);
+    }
+    flup_mutex_unlock(self->heapsLock);
+    tick++;
+
+    // Any neater way to deal this??? TwT
+    deadline.tv_nsec += 1'000'000'000 / STAT_COLLECTOR_HZ;
+    if (deadline.tv_nsec >= 1'000'000'000) {
+      deadline.tv_nsec -= 1'000'000'000;
+      deadline.tv_sec++;
+    }
+
+    int ret = 0;
+    while ((ret = clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &deadline, NULL)) == EINTR)
+      ;
+
+    if (ret != 0)
+      flup_panic("clock_nanosleep failed: %d", ret);
+  }
+
+  pr_info("Quit requested, quiting");
+}
+
+struct gc_runtime* gc_runtime_new_with_memory_hint(const struct gc_options* options, unsigned int workerCount, void* memoryHint) {
+  if (workerCount == 0)
+    workerCount = 1;
+
+  struct gc_runtime* self = malloc(sizeof(*self));
+  if (!self)
+    return NULL;
+
+  *self = (struct gc_runtime) {
+    .options = *options,
+    .pendingCycles = FLUP_LIST_HEAD_INIT(self->pendingCycles),
+    .heaps = FLUP_LIST_HEAD_INIT(self->heaps)
+  };
+  self->options.runtime = NULL;
+  self->options.cpuList = resolveCpuList(options, memoryHint);
+
+  if (!(self->lock = flup_mutex_new()))
+    goto failure;
+  if (!(self->cycleRequestedEvent = flup_cond_new()))
+    goto failure;
+  if (!(self->cycleFinishedEvent = flup_cond_new()))
+    goto failure;
+  if (!(self->heapsLock = flup_mutex_new()))
+    goto failure;
+
+  if (!(self->workers = calloc(workerCount, sizeof(*self->workers))))
+    goto failure;
+  for (unsigned int i = 0; i < workerCount; i++) {
+    struct gc_runtime_worker* worker = &self->workers[i];
+    worker->runtime = self;
+    mark_stack_init(&worker->markStack);
+    if (!(worker->thread = flup_thread_new(workerThread, worker)))
+      goto failure;
+    self->workerCount++;
+  }
+
+  if (!(self->schedulerThread = flup_thread_new(schedulerThread, self)))
+    goto failure;
+  return self;
+
+failure:
+  gc_runtime_free(self);
+  return NULL;
+}
+
+struct gc_runtime* gc_runtime_new(const struct gc_options* options, unsigned int workerCount) {
+  return gc_runtime_new_with_memory_hint(options, workerCount, NULL);
+}
+
+void gc_runtime_free(struct gc_runtime* self) {
+  if (!self)
+    return;
+
+  if (self->heapsLock) {
+    flup_mutex_lock(self->heapsLock);
+    if (!flup_list_is_empty(&self->heaps))
+      flup_panic("Not all heaps unregistered!");
+    flup_mutex_unlock(self->heapsLock);
+  }
+
+  if (self->schedulerThread) {
+    atomic_store(&self->schedulerQuitRequested, true);
+    flup_thread_wait(self->schedulerThread);
+    flup_thread_free(self->schedulerThread);
+  }
+
+  if (self->workerCount > 0) {
+    flup_mutex_lock(self->lock);
+    self->quitRequested = true;
+    flup_cond_wake_all(self->cycleRequestedEvent);
+    flup_mutex_unlock(self->lock);
+  }
+
+  for (unsigned int i = 0; i < self->workerCount; i++) {
+    flup_thread_wait(self->workers[i].thread);
+    flup_thread_free(self->workers[i].thread);
+    mark_stack_cleanup(&self->workers[i].markStack);
+  }
+  free(self->workers);
+
+  flup_mutex_free(self->heapsLock);
+  flup_cond_free(self->cycleFinishedEvent);
+  flup_cond_free(self->cycleRequestedEvent);
+  flup_mutex_free(self->lock);
+  free((char*) self->options.cpuList);
+  free(self);
+}
+
+void gc_runtime_register(struct gc_runtime* self, struct gc_per_generation_state* gcState) {
+  gcState->runtime = self;
+  flup_mutex_lock(self->heapsLock);
+  flup_list_add_tail(&self->heaps, &gcState->runtimeNode);
+  flup_mutex_unlock(self->heapsLock);
+}
+
+void gc_runtime_unregister(struct gc_runtime* self, struct gc_per_generation_state* gcState) {
+  // Scheduler polls under heapsLock so after this
+  // the heap's driver is never touched again
+  flup_mutex_lock(self->heapsLock);
+  flup_list_del(&gcState->runtimeNode);
+  flup_mutex_unlock(self->heapsLock);
+
+  flup_mutex_lock(self->lock);
+  if (gcState->cycleQueued) {
+    flup_list_del(&gcState->runtimePendingNode);
+    gcState->cycleQueued = false;
+  }
+  gcState->cycleRequestedAgain = false;
+  while (gcState->cycleRunning)
+    flup_cond_wait(self->cycleFinishedEvent, self->lock, NULL);
+
+  // Worker may re-queued it while we waited
+  if (gcState->cycleQueued) {
+    flup_list_del(&gcState->runtimePendingNode);
+    gcState->cycleQueued = false;
+  }
+  flup_mutex_unlock(self->lock);
+}
+
+void gc_runtime_request_cycle(struct gc_runtime* self, struct gc_per_generation_state* gcState) {
+  flup_mutex_lock(self->lock);
+  if (gcState->cycleRunning) {
+    // Worker queues it again once current cycle done
+    gcState->cycleRequestedAgain = true;
+  } else if (!gcState->cycleQueued) {
+    gcState->cycleQueued = true;
+    flup_list_add_tail(&self->pendingCycles, &gcState->runtimePendingNode);
+    flup_cond_wake_one(self->cycleRequestedEvent);
+  }
+  flup_mutex_unlock(self->lock);
+}
+
+void gc_runtime_setup_current_thread(struct gc_runtime* self) {
+  int ret;
+  if (self->options.cpuList && (ret = platform_set_current_thread_affinity(self->options.cpuList)) < 0)
+    pr_warn("Cannot set affinity of GC thread to %s: %d", self->options.cpuList, ret);
+
+  bool isDefaultSched = self->options.concurrentSchedPolicy == PLATFORM_SCHED_NORMAL && self->options.concurrentNice == 0;
+  if (!isDefaultSched && (ret = platform_set_current_thread_sched(self->options.concurrentSchedPolicy, self->options.concurrentNice)) < 0)
+    pr_warn("Cannot set scheduling of GC thread: %d", ret);
+}
+
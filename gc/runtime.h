@@ -0,0 +1,78 @@
+#ifndef UWU_6E1B3F8A_2C47_4D95_B0A3_97E5D4C1F826_UWU
+#define UWU_6E1B3F8A_2C47_4D95_B0A3_97E5D4C1F826_UWU
+
+#include <stdatomic.h>
+
+#include <flup/concurrency/cond.h>
+#include <flup/concurrency/mutex.h>
+#include <flup/data_structs/list_head.h>
+#include <flup/thread/thread.h>
+
+#include "gc/gc.h"
+#include "gc/mark_stack.h"
+
+// GC runtime which multiple heaps can share, it owns pool of
+// workers which runs GC cycles for whichever heap requested one
+// and a scheduler thread which polls every heaps' driver and stat
+// collector. So heaps only cost their metadata instead of threads
+//
+// Heaps created without a runtime get a private one with single
+// worker
+
+struct gc_runtime;
+
+struct gc_runtime_worker {
+  struct gc_runtime* runtime;
+  flup_thread* thread;
+
+  // Each worker marks with its own stack
+  struct mark_stack markStack;
+};
+
+struct gc_runtime {
+  // Placement and scheduling of runtime's threads,
+  // "cpuList" owned by runtime
+  struct gc_options options;
+
+  // Protects "pendingCycles" and per heap queued/running
+  // status, workers wait on "cycleRequestedEvent"
+  flup_mutex* lock;
+  flup_cond* cycleRequestedEvent;
+  flup_cond* cycleFinishedEvent;
+  flup_list_head pendingCycles;
+  bool quitRequested;
+
+  // Protects "heaps", held by scheduler while polling
+  // so unregistering waits for it
+  flup_mutex* heapsLock;
+  flup_list_head heaps;
+
+  unsigned int workerCount;
+  struct gc_runtime_worker* workers;
+
+  flup_thread* schedulerThread;
+  atomic_bool schedulerQuitRequested;
+};
+
+struct gc_runtime* gc_runtime_new(const struct gc_options* options, unsigned int workerCount);
+
+// Every heaps must be freed before the runtime
+void gc_runtime_free(struct gc_runtime* self);
+
+// Same as gc_runtime_new, but NUMA node auto placement
+// uses "memoryHint" to find the node
+struct gc_runtime* gc_runtime_new_with_memory_hint(const struct gc_options* options, unsigned int workerCount, void* memoryHint);
+
+// Used by GC internally
+void gc_runtime_register(struct gc_runtime* self, struct gc_per_generation_state* gcState);
+
+// Waits for cycle running on the heap to complete
+// and pending request is discarded
+void gc_runtime_unregister(struct gc_runtime* self, struct gc_per_generation_state* gcState);
+void gc_runtime_request_cycle(struct gc_runtime* self, struct gc_per_generation_state* gcState);
+
+// Apply placement and scheduling options to calling thread
+void gc_runtime_setup_current_thread(struct gc_runtime* self);
+
+#endif
+
@@ -3,8 +3,6 @@
 
 #include <stdatomic.h>
 
-#include <flup/thread/thread.h>
-
 #include "gc/gc.h"
 #include "util/moving_window.h"
 
@@ -13,9 +11,8 @@
 
 struct stat_collector {
   struct gc_per_generation_state* gcState;
-  flup_thread* thread;
-  atomic_bool quitRequested;
   atomic_bool paused;
+  size_t lastLifetimeBytes;
   
   // Alloc rate is in unit of bytes per 1/STAT_COLLECTOR_HZ
   struct moving_window* allocRateSamples;
@@ -27,7 +24,10 @@ struct stat_collector {
 
 struct stat_collector* stat_collector_new(struct gc_per_generation_state* gcState);
 void stat_collector_unpause(struct stat_collector* self);
-void stat_collector_perform_shutdown(struct stat_collector* self);
+
+// Take one sample, called by runtime's scheduler
+// STAT_COLLECTOR_HZ times a second
+void stat_collector_poll(struct stat_collector* self);
 void stat_collector_free(struct stat_collector* self);
 
 #endif
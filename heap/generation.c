@@ -1,21 +1,130 @@
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+#include <flup/core/logger.h>
+
 #include "generation.h"
 #include "gc/gc.h"
 #include "memory/alloc_tracker.h"
 #include "heap/heap.h"
 
-struct generation* generation_new(size_t sz) {
+#undef FLUP_LOG_CATEGORY
+#define FLUP_LOG_CATEGORY "Generation"
+
+#ifdef CONFIG_OBJECT_COMPACT_HEADER
+// Address range of each generation's arena, writers serialized
+// by "rangesLock" and readers check "sequence" which is odd
+// while the slot being changed
+struct generation_range {
+  atomic_uint sequence;
+  _Atomic(uintptr_t) start;
+  _Atomic(uintptr_t) end;
+  _Atomic(struct generation*) gen;
+};
+
+static struct generation_range ranges[GENERATION_MAX_COUNT];
+// Slots above it never used
+static atomic_uint rangesUsed;
+// Only taken on creating and freeing generation
+// so spinning is fine
+static atomic_flag rangesLock = ATOMIC_FLAG_INIT;
+
+static void lockRanges() {
+  while (atomic_flag_test_and_set_explicit(&rangesLock, memory_order_acquire))
+    ;
+}
+
+static void unlockRanges() {
+  atomic_flag_clear_explicit(&rangesLock, memory_order_release);
+}
+
+static void writeRange(struct generation_range* range, uintptr_t start, uintptr_t end, struct generation* gen) {
+  unsigned int sequence = atomic_load_explicit(&range->sequence, memory_order_relaxed);
+  atomic_store_explicit(&range->sequence, sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&range->start, start, memory_order_relaxed);
+  atomic_store_explicit(&range->end, end, memory_order_relaxed);
+  atomic_store_explicit(&range->gen, gen, memory_order_relaxed);
+  atomic_store_explicit(&range->sequence, sequence + 2, memory_order_release);
+}
+
+static bool registerRange(struct generation* self) {
+  uintptr_t start = (uintptr_t) self->allocTracker->arenaStart;
+  uintptr_t end = start + self->allocTracker->arenaSize;
+  
+  lockRanges();
+  unsigned int used = atomic_load_explicit(&rangesUsed, memory_order_relaxed);
+  unsigned int i;
+  for (i = 0; i < used; i++)
+    if (atomic_load_explicit(&ranges[i].gen, memory_order_relaxed) == NULL)
+      break;
+  
+  if (i == GENERATION_MAX_COUNT) {
+    unlockRanges();
+    pr_error("Too many generations (maximum %d) for compact object header", GENERATION_MAX_COUNT);
+    return false;
+  }
+  
+  writeRange(&ranges[i], start, end, self);
+  if (i == used)
+    atomic_store_explicit(&rangesUsed, used + 1, memory_order_release);
+  unlockRanges();
+  return true;
+}
+
+static void unregisterRange(struct generation* self) {
+  lockRanges();
+  unsigned int used = atomic_load_explicit(&rangesUsed, memory_order_relaxed);
+  for (unsigned int i = 0; i < used; i++) {
+    if (atomic_load_explicit(&ranges[i].gen, memory_order_relaxed) != self)
+      continue;
+    writeRange(&ranges[i], 0, 0, NULL);
+    break;
+  }
+  unlockRanges();
+}
+
+struct generation* generation_from_address(void* addr) {
+  unsigned int used = atomic_load_explicit(&rangesUsed, memory_order_acquire);
+  for (unsigned int i = 0; i < used; i++) {
+    struct generation_range* range = &ranges[i];
+    unsigned int sequence;
+    uintptr_t start, end;
+    struct generation* gen;
+    
+    do {
+      sequence = atomic_load_explicit(&range->sequence, memory_order_acquire);
+      start = atomic_load_explicit(&range->start, memory_order_relaxed);
+      end = atomic_load_explicit(&range->end, memory_order_relaxed);
+      gen = atomic_load_explicit(&range->gen, memory_order_relaxed);
+      atomic_thread_fence(memory_order_acquire);
+    } while ((sequence & 1) || atomic_load_explicit(&range->sequence, memory_order_relaxed) != sequence);
+    
+    if ((uintptr_t) addr >= start && (uintptr_t) addr < end)
+      return gen;
+  }
+  return NULL;
+}
+#endif
+
+struct generation* generation_new(size_t sz, enum platform_page_mode pageMode, const struct gc_options* gcOptions) {
   struct generation* self = malloc(sizeof(*self));
   if (!self)
     return NULL;
   
   *self = (struct generation) {};
-  if (!(self->allocTracker = alloc_tracker_new(sz)))
+  if (!(self->allocTracker = alloc_tracker_new(sz, pageMode)))
+    goto failure;
+  
+#ifdef CONFIG_OBJECT_COMPACT_HEADER
+  if (!registerRange(self))
     goto failure;
+  self->rangeRegistered = true;
+#endif
   
-  if (!(self->gcState = gc_per_generation_state_new(self)))
+  if (!(self->gcState = gc_per_generation_state_new(self, gcOptions)))
     goto failure;
   return self;
 
@@ -28,15 +137,28 @@ void generation_free(struct generation* self) {
   if (!self)
     return;
   gc_per_generation_state_free(self->gcState);
+#ifdef CONFIG_OBJECT_COMPACT_HEADER
+  if (self->rangeRegistered)
+    unregisterRange(self);
+#endif
   alloc_tracker_free(self->allocTracker);
   free(self);
 }
 
-struct alloc_unit* generation_alloc(struct generation* self, size_t size) {
-  struct alloc_unit* block = alloc_tracker_alloc(self->allocTracker, heap_get_alloc_context(self->ownerHeap), size);
+struct alloc_unit* generation_alloc(struct generation* self, struct descriptor* desc, size_t size) {
+  struct alloc_context* ctx = heap_get_alloc_context(self->ownerHeap);
+  struct alloc_unit* block = alloc_tracker_alloc_recycled(self->allocTracker, ctx, desc, size);
+  if (block)
+    return block;
+  
+  block = alloc_tracker_alloc(self->allocTracker, ctx, size);
   if (!block)
     return NULL;
   
   return block;
 }
 
+bool generation_alloc_many(struct generation* self, size_t count, size_t size, struct alloc_unit** blocks) {
+  return alloc_tracker_alloc_many(self->allocTracker, heap_get_alloc_context(self->ownerHeap), count, size, blocks);
+}
+
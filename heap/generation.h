@@ -5,15 +5,33 @@
 
 #include "gc/gc.h"
 
+struct descriptor;
+
 struct generation {
   struct heap* ownerHeap;
   struct alloc_tracker* allocTracker;
   struct gc_per_generation_state* gcState;
+  
+#ifdef CONFIG_OBJECT_COMPACT_HEADER
+  bool rangeRegistered;
+#endif
 };
 
-struct generation* generation_new(size_t size);
+struct generation* generation_new(size_t size, enum platform_page_mode pageMode, const struct gc_options* gcOptions);
 void generation_free(struct generation* self);
 
-struct alloc_unit* generation_alloc(struct generation* self, size_t size);
+// Reuses recycled block if "desc" and "size" is recycled type
+// in that case the block already has "desc" and initialized
+struct alloc_unit* generation_alloc(struct generation* self, struct descriptor* desc, size_t size);
+bool generation_alloc_many(struct generation* self, size_t count, size_t size, struct alloc_unit** blocks);
+
+#ifdef CONFIG_OBJECT_COMPACT_HEADER
+// Maximum number of generations alive at once as compact
+// header finds owning generation by address of the block
+#define GENERATION_MAX_COUNT (64)
+
+// "addr" must be within live generation's heap, lock free
+struct generation* generation_from_address(void* addr);
+#endif
 
 #endif
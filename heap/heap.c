@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -13,6 +14,7 @@
 #include <flup/data_structs/list_head.h>
 
 #include "heap.h"
+#include "gc/alloc_profiler.h"
 #include "gc/driver.h"
 #include "gc/gc.h"
 #include "heap/generation.h"
@@ -20,6 +22,7 @@
 #include "memory/alloc_context.h"
 #include "memory/alloc_tracker.h"
 #include "object/descriptor.h"
+#include "object/ref.h"
 
 #undef FLUP_LOG_CATEGORY
 #define FLUP_LOG_CATEGORY "Heap"
@@ -27,18 +30,25 @@
 #define HEAP_ALLOC_RETRY_COUNT 5
 
 struct heap* heap_new(size_t size) {
+  struct heap_options options = HEAP_OPTIONS_DEFAULT;
+  return heap_new_with_options(size, &options);
+}
+
+struct heap* heap_new_with_options(size_t size, const struct heap_options* options) {
   struct heap* self = malloc(sizeof(*self));
   if (!self)
     return NULL;
   
   *self = (struct heap) {
-    .threads = FLUP_LIST_HEAD_INIT(self->threads)
+    .threads = RCU_LIST_INIT
   };
   
   if (!(self->threadListLock = flup_mutex_new()))
     goto failure;
+  if (!(self->threadsRcu = rcu_domain_new()))
+    goto failure;
   
-  if (!(self->gen = generation_new(size)))
+  if (!(self->gen = generation_new(size, options->pageMode, &options->gc)))
     goto failure;
   self->gen->ownerHeap = self;
   if (!(self->currentThread = flup_thread_local_new(NULL)))
@@ -61,12 +71,8 @@ struct thread* heap_get_current_thread(struct heap* self) {
   return (struct thread*) flup_thread_local_get(self->currentThread);
 }
 
-static void removeThread(struct heap* self, struct thread* thread) {
-  flup_mutex_lock(self->threadListLock);
-  flup_list_del(&thread->node);
-  flup_mutex_unlock(self->threadListLock);
-  
-  thread_free(thread);
+static void reclaimThread(struct rcu_head* head) {
+  thread_free(rcu_list_entry(head, struct thread, rcuHead));
 }
 
 void heap_free(struct heap* self) {
@@ -74,12 +80,21 @@ void heap_free(struct heap* self) {
     return;
   
   pr_info("Shutting down...");
+  
+  // GC may still running a cycle and need to stop this thread
+  struct thread* currentThread = heap_get_current_thread(self);
+  if (currentThread)
+    gc_enter_native(self->gen->gcState, currentThread);
   gc_perform_shutdown(self->gen->gcState);
   flup_thread_local_free(self->currentThread);
-  flup_list_head* current;
-  flup_list_head *next;
-  flup_list_for_each_safe(&self->threads, current, next)
-    removeThread(self, flup_list_entry(current, struct thread, node));
+  
+  // Nobody else can walk the list anymore
+  struct rcu_list_node* current;
+  while ((current = atomic_load(&self->threads.head))) {
+    rcu_list_del(&self->threads, current);
+    thread_free(rcu_list_entry(current, struct thread, node));
+  }
+  rcu_domain_free(self->threadsRcu);
   generation_free(self->gen);
   flup_mutex_free(self->threadListLock);
   free(self);
@@ -95,32 +110,93 @@ void heap_root_unref(struct heap* self, struct root_ref* ref) {
   heap_unblock_gc(self);
 }
 
-struct root_ref* heap_alloc_with_descriptor(struct heap* self, struct descriptor* desc, size_t extraSize) {
-  struct root_ref* ref = heap_alloc(self, desc->objectSize + extraSize);
-  if (!ref)
-    return NULL;
+int heap_push_frame(struct heap* self) {
+  heap_block_gc(self);
+  int ret = thread_push_frame_no_gc_block(heap_get_current_thread(self));
+  heap_unblock_gc(self);
+  return ret;
+}
+
+void heap_pop_frame(struct heap* self) {
+  heap_block_gc(self);
+  thread_pop_frame_no_gc_block(heap_get_current_thread(self));
+  heap_unblock_gc(self);
+}
+
+bool heap_retry_alloc_blocked(struct heap* self, bool (^attempt)(void)) {
+  bool success = attempt();
+  for (int i = 0; i < HEAP_ALLOC_RETRY_COUNT && !success; i++) {
+    pr_info("Allocation failed trying calling GC #%d, GC was %srunning", i + 1, atomic_load(&self->gen->gcState->cycleInProgress) ? "" : "not ");
+    heap_unblock_gc(self);
+    gc_notify_memory_pressure(self->gen->gcState);
+    heap_enter_native(self);
+    gc_start_cycle(self->gen->gcState);
+    heap_exit_native(self);
+    heap_block_gc(self);
+    success = attempt();
+  }
+  return success;
+}
+
+static struct alloc_unit* allocBlockedWithRetry(struct heap* self, struct descriptor* desc, size_t size) {
+  __block struct alloc_unit* newObj = NULL;
+  heap_retry_alloc_blocked(self, ^bool (void) {
+    return (newObj = generation_alloc(self->gen, desc, size)) != NULL;
+  });
+  return newObj;
+}
+
+static void doPacing(struct heap* self) {
+  // Pacing may sleep, don't let GC wait for it
+  heap_enter_native(self);
+  gc_on_preallocate(self->gen);
+  heap_exit_native(self);
+}
+
+// Compact header stores descriptor's index, so it has
+// to have one before objects can use it
+static bool prepareDescriptor(struct descriptor* desc) {
+#ifdef CONFIG_OBJECT_COMPACT_HEADER
+  if (descriptor_get_index(desc) < 0) {
+    pr_error("Descriptor table is full, can't allocate object with new descriptor");
+    return false;
+  }
+#else
+  (void) desc;
+#endif
+  return true;
+}
+
+// Must be called with GC blocked so sweeper never
+// sees sampled object before profiler knows it
+static void sampleAllocation(struct heap* self, struct alloc_unit* obj, size_t size) {
+  struct alloc_profiler* profiler = self->gen->gcState->allocProfiler;
+  if (!profiler)
+    return;
   
-  descriptor_init_object(desc, extraSize, ref->obj->data);
-  atomic_store_explicit(&ref->obj->desc, desc, memory_order_release);
-  return ref;
+  struct thread* thread = heap_get_current_thread(self);
+  if (alloc_profiler_should_sample(&thread->allocProfilerState, size))
+    alloc_profiler_record_alloc(profiler, &thread->allocProfilerState, obj, size);
 }
 
-struct root_ref* heap_alloc(struct heap* self, size_t size) {
+static void initObject(struct alloc_unit* obj, struct descriptor* desc, size_t extraSize) {
+  // Recycled object already initialized
+  if (alloc_unit_get_descriptor(obj, memory_order_relaxed) == desc)
+    return;
+  
+  descriptor_init_object(desc, extraSize, obj->data);
+  alloc_unit_set_descriptor(obj, desc);
+}
+
+static struct root_ref* allocRooted(struct heap* self, struct descriptor* desc, size_t size) {
   struct root_ref* ref = thread_prealloc_root_ref(heap_get_current_thread(self));
   if (!ref)
     return NULL;
   
-  gc_on_preallocate(self->gen);
+  doPacing(self);
   
   heap_block_gc(self);
-  struct alloc_unit* newObj = generation_alloc(self->gen, size);
-  for (int i = 0; i < HEAP_ALLOC_RETRY_COUNT && newObj == NULL; i++) {
-    pr_info("Allocation failed trying calling GC #%d, GC was %srunning", i + 1, atomic_load(&self->gen->gcState->cycleInProgress) ? "" : "not ");
-    heap_unblock_gc(self);
-    gc_start_cycle(self->gen->gcState);
-    heap_block_gc(self);
-    newObj = generation_alloc(self->gen, size);
-  }
+  struct alloc_unit* newObj = allocBlockedWithRetry(self, desc, size);
   
   // Heap is actually OOM-ed
   if (!newObj) {
@@ -131,10 +207,130 @@ struct root_ref* heap_alloc(struct heap* self, size_t size) {
   
   thread_new_root_ref_from_prealloc_no_gc_block(heap_get_current_thread(self), ref, newObj);
   gc_on_allocate(newObj, self->gen);
+  sampleAllocation(self, newObj, size);
   heap_unblock_gc(self);
   return ref;
 }
 
+struct root_ref* heap_alloc_with_descriptor(struct heap* self, struct descriptor* desc, size_t extraSize) {
+  if (!prepareDescriptor(desc))
+    return NULL;
+  
+  struct root_ref* ref = allocRooted(self, desc, desc->objectSize + extraSize);
+  if (!ref)
+    return NULL;
+  
+  initObject(ref->obj, desc, extraSize);
+  return ref;
+}
+
+struct root_ref* heap_alloc(struct heap* self, size_t size) {
+  return allocRooted(self, NULL, size);
+}
+
+static struct alloc_unit* allocInto(struct heap* self, struct alloc_unit* parent, size_t offset, struct descriptor* desc, size_t extraSize, size_t size) {
+  doPacing(self);
+  
+  heap_block_gc(self);
+  struct alloc_unit* newObj = allocBlockedWithRetry(self, desc, size);
+  
+  // Heap is actually OOM-ed
+  if (!newObj) {
+    heap_unblock_gc(self);
+    return NULL;
+  }
+  
+  gc_on_allocate(newObj, self->gen);
+  sampleAllocation(self, newObj, size);
+  
+  // Other threads can see it once its in "parent", so
+  // fields must be cleared and descriptor set before
+  if (desc)
+    initObject(newObj, desc, extraSize);
+  atomic_thread_fence(memory_order_release);
+  
+  // New object is already marked so only the
+  // overwritten one need to be remarked
+  gc_need_remark(object_ref_exchange(self->gen->allocTracker->refBase, parent->data, offset, newObj));
+  heap_unblock_gc(self);
+  return newObj;
+}
+
+struct alloc_unit* heap_alloc_into_with_descriptor(struct heap* self, struct alloc_unit* parent, size_t offset, struct descriptor* desc, size_t extraSize) {
+  if (!prepareDescriptor(desc))
+    return NULL;
+  
+  return allocInto(self, parent, offset, desc, extraSize, desc->objectSize + extraSize);
+}
+
+struct alloc_unit* heap_alloc_into(struct heap* self, struct alloc_unit* parent, size_t offset, size_t size) {
+  return allocInto(self, parent, offset, NULL, 0, size);
+}
+
+int heap_add_recycled_type(struct heap* self, struct descriptor* desc, size_t size) {
+  return alloc_tracker_add_recycled_type(self->gen->allocTracker, desc, size);
+}
+
+int heap_alloc_bulk_with_descriptor(struct heap* self, struct descriptor* desc, size_t extraSize, size_t count, struct root_ref** refs) {
+  if (!prepareDescriptor(desc))
+    return -ENOSPC;
+  
+  int ret = heap_alloc_bulk(self, count, desc->objectSize + extraSize, refs);
+  if (ret < 0)
+    return ret;
+  
+  for (size_t i = 0; i < count; i++) {
+    descriptor_init_object(desc, extraSize, refs[i]->obj->data);
+    alloc_unit_set_descriptor(refs[i]->obj, desc);
+  }
+  return 0;
+}
+
+int heap_alloc_bulk(struct heap* self, size_t count, size_t size, struct root_ref** refs) {
+  if (count == 0)
+    return 0;
+  if (count > SIZE_MAX / sizeof(struct alloc_unit*))
+    return -ENOMEM;
+  
+  struct thread* thread = heap_get_current_thread(self);
+  struct alloc_unit** blocks = malloc(sizeof(*blocks) * count);
+  if (!blocks)
+    return -ENOMEM;
+  
+  size_t preallocatedCount;
+  for (preallocatedCount = 0; preallocatedCount < count; preallocatedCount++)
+    if (!(refs[preallocatedCount] = thread_prealloc_root_ref(thread)))
+      goto prealloc_failure;
+  
+  doPacing(self);
+  
+  heap_block_gc(self);
+  bool success = heap_retry_alloc_blocked(self, ^bool (void) {
+    return generation_alloc_many(self->gen, count, size, blocks);
+  });
+  
+  // Heap is actually OOM-ed
+  if (!success) {
+    heap_unblock_gc(self);
+    goto prealloc_failure;
+  }
+  
+  for (size_t i = 0; i < count; i++) {
+    thread_new_root_ref_from_prealloc_no_gc_block(thread, refs[i], blocks[i]);
+    gc_on_allocate(blocks[i], self->gen);
+    sampleAllocation(self, blocks[i], size);
+  }
+  heap_unblock_gc(self);
+  free(blocks);
+  return 0;
+
+prealloc_failure:
+  for (size_t i = 0; i < preallocatedCount; i++)
+    free(refs[i]);
+  free(blocks);
+  return -ENOMEM;
+}
+
 void heap_block_gc(struct heap* self) {
   gc_block(self->gen->gcState, heap_get_current_thread(self));
 }
@@ -143,25 +339,56 @@ void heap_unblock_gc(struct heap* self) {
   gc_unblock(self->gen->gcState, heap_get_current_thread(self));
 }
 
+void heap_enter_native(struct heap* self) {
+  gc_enter_native(self->gen->gcState, heap_get_current_thread(self));
+}
+
+void heap_exit_native(struct heap* self) {
+  gc_exit_native(self->gen->gcState, heap_get_current_thread(self));
+}
+
+void heap_safepoint_poll(struct heap* self) {
+  gc_safepoint_poll(self->gen->gcState, heap_get_current_thread(self));
+}
+
 struct alloc_context* heap_get_alloc_context(struct heap* self) {
   return heap_get_current_thread(self)->allocContext;
 }
 
 void heap_iterate_threads(struct heap* self, void (^iterator)(struct thread* thrd)) {
+  unsigned int rcuIndex = rcu_read_enter(self->threadsRcu);
+  struct rcu_list_node* current;
+  rcu_list_for_each(&self->threads, current)
+    iterator(rcu_list_entry(current, struct thread, node));
+  rcu_read_exit(self->threadsRcu, rcuIndex);
+}
+
+void heap_reap_detached_threads(struct heap* self) {
   flup_mutex_lock(self->threadListLock);
-  flup_list_head* current;
-  flup_list_for_each(&self->threads, current)
-    iterator(flup_list_entry(current, struct thread, node));
+  struct rcu_list_node* current = atomic_load_explicit(&self->threads.head, memory_order_relaxed);
+  while (current) {
+    struct rcu_list_node* next = atomic_load_explicit(&current->next, memory_order_relaxed);
+    struct thread* thrd = rcu_list_entry(current, struct thread, node);
+    if (atomic_load_explicit(&thrd->detached, memory_order_acquire)) {
+      rcu_list_del(&self->threads, current);
+      rcu_retire(self->threadsRcu, &thrd->rcuHead, reclaimThread);
+    }
+    current = next;
+  }
   flup_mutex_unlock(self->threadListLock);
+  
+  rcu_poll(self->threadsRcu);
 }
 
+// Lock here only serializes with other writers, GC
+// iterating threads during pause don't hold it
 struct thread* heap_attach_thread(struct heap* self) {
   struct thread* thrd = thread_new(self);
   if (!thrd)
     return NULL;
   
   flup_mutex_lock(self->threadListLock);
-  flup_list_add_head(&self->threads, &thrd->node);
+  rcu_list_add_head(&self->threads, &thrd->node);
   flup_mutex_unlock(self->threadListLock);
   
   flup_thread_local_set(self->currentThread, (uintptr_t) thrd);
@@ -169,7 +396,10 @@ struct thread* heap_attach_thread(struct heap* self) {
 }
 
 void heap_detach_thread(struct heap* self) {
-  removeThread(self, heap_get_current_thread(self));
+  thread_detach(heap_get_current_thread(self));
   flup_thread_local_set(self->currentThread, (uintptr_t) NULL);
+  
+  // Opportunistically free threads which detached earlier
+  rcu_poll(self->threadsRcu);
 }
 
@@ -11,6 +11,7 @@
 #include "memory/alloc_tracker.h"
 #include "memory/alloc_context.h"
 #include "object/descriptor.h"
+#include "util/rcu.h"
 
 struct descriptor;
 struct thread;
@@ -19,8 +20,12 @@ struct heap {
   struct generation* gen;
   
   flup_thread_local* currentThread;
+  
+  // Serializes writers of "threads" only, readers
+  // walk it under threadsRcu read side
   flup_mutex* threadListLock;
-  flup_list_head threads;
+  struct rcu_list threads;
+  struct rcu_domain* threadsRcu;
 };
 
 struct root_ref {
@@ -30,24 +35,87 @@ struct root_ref {
 
 // Thread management
 struct thread* heap_get_current_thread(struct heap* self);
+
+// Include detached threads which GC hasn't freed yet, never
+// blocks attaching or detaching threads
 void heap_iterate_threads(struct heap* self, void (^iterator)(struct thread* thrd));
 
+// Unlink detached threads and free them once nobody iterating
+// can see them, used by GC after marking completed
+void heap_reap_detached_threads(struct heap* self);
+
 struct thread* heap_attach_thread(struct heap* self);
 void heap_detach_thread(struct heap* self);
 
+struct heap_options {
+  struct gc_options gc;
+  
+  // Backing of heap memory, falls back to smaller pages
+  // if not available, see alloc_tracker_get_statistics
+  // for mode which actually used
+  enum platform_page_mode pageMode;
+};
+
+#define HEAP_OPTIONS_DEFAULT ((struct heap_options) { \
+  .gc = GC_OPTIONS_DEFAULT, \
+  .pageMode = PLATFORM_PAGE_DEFAULT \
+})
+
 struct heap* heap_new(size_t size);
+struct heap* heap_new_with_options(size_t size, const struct heap_options* options);
 void heap_free(struct heap* self);
 
 struct root_ref* heap_alloc(struct heap* self, size_t size);
 struct root_ref* heap_alloc_with_descriptor(struct heap* self, struct descriptor* desc, size_t extraSize);
 
+// Allocate new object and store it straight into "parent"'s field
+// at "offset" without creating root ref. Returned pointer only
+// stays valid while the object reachable from "parent"
+struct alloc_unit* heap_alloc_into(struct heap* self, struct alloc_unit* parent, size_t offset, size_t size);
+struct alloc_unit* heap_alloc_into_with_descriptor(struct heap* self, struct alloc_unit* parent, size_t offset, struct descriptor* desc, size_t extraSize);
+
+// Let dead objects with "desc" (NULL for heap_alloc-ed objects) and
+// total "size" (desc->objectSize + extraSize for objects with descriptor)
+// be reused by the thread which allocated them instead of going back to
+// allocator. Return -ENOSPC if there already too many recycled types
+int heap_add_recycled_type(struct heap* self, struct descriptor* desc, size_t size);
+
+// Allocate "count" objects of same size at once into "refs" array
+// with single GC block and accounting reservation. Either all of
+// them allocated or none of them (-ENOMEM returned)
+int heap_alloc_bulk(struct heap* self, size_t count, size_t size, struct root_ref** refs);
+// Also returns -ENOSPC if compact header's descriptor table is full
+int heap_alloc_bulk_with_descriptor(struct heap* self, struct descriptor* desc, size_t extraSize, size_t count, struct root_ref** refs);
+
+// Must be called with GC blocked. Retries "attempt" while it fails
+// because heap is full, unblocking GC and waiting for a cycle between
+// tries. Returns false if heap still full after few cycles
+bool heap_retry_alloc_blocked(struct heap* self, bool (^attempt)(void));
+
 struct root_ref* heap_new_root_ref_unlocked(struct heap* self, struct alloc_unit* obj);
 void heap_root_unref(struct heap* self, struct root_ref* ref);
 
+// Local frames, every root refs created after push released at
+// once by the matching pop. Root refs from outer frames can still
+// be unref-ed individually. Push returns -ENOMEM on failure
+int heap_push_frame(struct heap* self);
+void heap_pop_frame(struct heap* self);
+
 // These can't be nested
 void heap_block_gc(struct heap* self);
 void heap_unblock_gc(struct heap* self);
 
+// Calling thread promises not to touch the heap until
+// heap_exit_native, must be used around long operations
+// when cooperative safepoint is used (GC_LOCK_USE_SAFEPOINT)
+// else GC has to wait for the thread. These can't be nested
+void heap_enter_native(struct heap* self);
+void heap_exit_native(struct heap* self);
+
+// Let GC stop current thread if it requested so, for
+// long loops which don't allocate or use barriers
+void heap_safepoint_poll(struct heap* self);
+
 struct alloc_context* heap_get_alloc_context(struct heap* self);
 
 #endif
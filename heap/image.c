@@ -0,0 +1,559 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <flup/core/logger.h>
+
+#include "image.h"
+#include "gc/gc.h"
+#include "heap/generation.h"
+#include "heap/heap.h"
+#include "heap/thread.h"
+#include "memory/alloc_tracker.h"
+#include "object/descriptor.h"
+#include "object/ref.h"
+#include "platform/platform.h"
+
+#undef FLUP_LOG_CATEGORY
+#define FLUP_LOG_CATEGORY "Heap Image"
+
+// Image layout, every parts are 8 bytes aligned
+//
+// struct image_header
+// struct image_object[objectCount]
+// uint64_t roots[rootCount] (object index plus one, 0 for NULL)
+// Payloads of objects, reference fields contain object
+// index plus one in reference's size instead
+#define IMAGE_MAGIC "FluffyIm"
+#define IMAGE_VERSION (1)
+
+struct image_header {
+  char magic[8];
+  uint32_t version;
+  // sizeof(object_ref) of the build which saved it
+  uint32_t refSize;
+  uint64_t objectCount;
+  uint64_t rootCount;
+  // Descriptors used from caller's table
+  uint64_t descriptorCount;
+  uint64_t dataSize;
+};
+
+struct image_object {
+  uint64_t size;
+  // Index in caller's descriptor table plus one, 0 for none
+  uint64_t descriptor;
+  uint64_t dataOffset;
+};
+
+// Objects allocated or relocated per GC block while loading
+// so pauses don't wait for whole image
+#define IMAGE_LOAD_CHUNK_OBJECTS (4096)
+
+// Flex array of every loaded objects while loading
+static struct descriptor holderDescriptor = {
+  .hasFlexArrayField = true,
+  .fieldCount = 0,
+  .objectSize = 0
+};
+
+#define IMAGE_ALIGN(x) (((x) + 7) & ~((size_t) 7))
+
+// Pointer to index map for saving, open addressing
+struct ptr_map {
+  const void** keys;
+  uint64_t* values;
+  size_t capacity;
+  size_t count;
+};
+
+#define PTR_MAP_INITIAL_CAPACITY (1024)
+
+static size_t ptrMapSlot(struct ptr_map* self, const void* key) {
+  // Fibonacci hashing, low bits of pointers are mostly zero
+  uint64_t hash = ((uint64_t) (uintptr_t) key >> 3) * 11400714819323198485ull;
+  size_t mask = self->capacity - 1;
+  size_t slot = (size_t) (hash >> 32) & mask;
+  while (self->keys[slot] && self->keys[slot] != key)
+    slot = (slot + 1) & mask;
+  return slot;
+}
+
+static bool ptrMapInit(struct ptr_map* self, size_t capacity) {
+  *self = (struct ptr_map) {
+    .keys = calloc(capacity, sizeof(*self->keys)),
+    .values = calloc(capacity, sizeof(*self->values)),
+    .capacity = capacity
+  };
+  return self->keys && self->values;
+}
+
+static void ptrMapCleanup(struct ptr_map* self) {
+  free(self->keys);
+  free(self->values);
+}
+
+static bool ptrMapGet(struct ptr_map* self, const void* key, uint64_t* value) {
+  size_t slot = ptrMapSlot(self, key);
+  if (!self->keys[slot])
+    return false;
+  *value = self->values[slot];
+  return true;
+}
+
+// Key must not be in the map yet
+static bool ptrMapPut(struct ptr_map* self, const void* key, uint64_t value) {
+  // Keep load factor under a half
+  if ((self->count + 1) * 2 > self->capacity) {
+    struct ptr_map grown;
+    if (!ptrMapInit(&grown, self->capacity * 2)) {
+      ptrMapCleanup(&grown);
+      return false;
+    }
+
+    for (size_t i = 0; i < self->capacity; i++) {
+      if (!self->keys[i])
+        continue;
+      size_t slot = ptrMapSlot(&grown, self->keys[i]);
+      grown.keys[slot] = self->keys[i];
+      grown.values[slot] = self->values[i];
+    }
+    grown.count = self->count;
+    ptrMapCleanup(self);
+    *self = grown;
+  }
+
+  size_t slot = ptrMapSlot(self, key);
+  self->keys[slot] = key;
+  self->values[slot] = value;
+  self->count++;
+  return true;
+}
+
+static void forEachRefField(struct descriptor* desc, size_t size, void (^iterator)(size_t offset)) {
+  if (!desc)
+    return;
+
+  for (size_t i = 0; i < desc->fieldCount; i++)
+    iterator(desc->fields[i].offset);
+
+  if (!desc->hasFlexArrayField)
+    return;
+
+  size_t flexArrayCount = (size - desc->objectSize) / sizeof(object_ref);
+  for (size_t i = 0; i < flexArrayCount; i++)
+    iterator(desc->objectSize + i * sizeof(object_ref));
+}
+
+// References in image are stored in reference's own size
+static void writeIndex(char* field, uint64_t index) {
+  if (sizeof(object_ref) == sizeof(uint32_t)) {
+    uint32_t narrow = (uint32_t) index;
+    memcpy(field, &narrow, sizeof(narrow));
+  } else {
+    memcpy(field, &index, sizeof(index));
+  }
+}
+
+static uint64_t readIndex(const char* field) {
+  if (sizeof(object_ref) == sizeof(uint32_t)) {
+    uint32_t narrow;
+    memcpy(&narrow, field, sizeof(narrow));
+    return narrow;
+  }
+
+  uint64_t index;
+  memcpy(&index, field, sizeof(index));
+  return index;
+}
+
+struct saver {
+  void* refBase;
+  struct ptr_map objectIndices;
+  struct ptr_map descriptorIndices;
+
+  // Objects in order of their index
+  struct alloc_unit** objects;
+  struct image_object* table;
+  size_t objectCount;
+  size_t objectCapacity;
+
+  char* data;
+  size_t dataSize;
+  size_t dataCapacity;
+};
+
+// Gives object an index if it doesn't have one yet and
+// returns it plus one in "index", 0 for NULL
+static int visitObject(struct saver* self, struct alloc_unit* block, uint64_t* index) {
+  if (!block) {
+    *index = 0;
+    return 0;
+  }
+
+  if (ptrMapGet(&self->objectIndices, block, index))
+    return 0;
+
+  if (self->objectCount == self->objectCapacity) {
+    size_t newCapacity = self->objectCapacity * 2;
+    struct alloc_unit** newObjects = realloc(self->objects, newCapacity * sizeof(*newObjects));
+    if (!newObjects)
+      return -ENOMEM;
+    self->objects = newObjects;
+
+    struct image_object* newTable = realloc(self->table, newCapacity * sizeof(*newTable));
+    if (!newTable)
+      return -ENOMEM;
+    self->table = newTable;
+    self->objectCapacity = newCapacity;
+  }
+
+  *index = self->objectCount + 1;
+  if (!ptrMapPut(&self->objectIndices, block, *index))
+    return -ENOMEM;
+  self->objects[self->objectCount] = block;
+  self->objectCount++;
+  return 0;
+}
+
+// Copy payload into image data and replace references
+// with indices, giving indices to the referents
+static int saveObject(struct saver* self, size_t objectIndex) {
+  struct alloc_unit* block = self->objects[objectIndex];
+  size_t size = alloc_unit_get_size(block);
+  struct descriptor* desc = alloc_unit_get_descriptor(block, memory_order_acquire);
+
+  uint64_t descriptorIndex = 0;
+  if (desc && !ptrMapGet(&self->descriptorIndices, desc, &descriptorIndex)) {
+    pr_error("Object %p has descriptor %p which not in the descriptor table", block, desc);
+    return -EINVAL;
+  }
+
+  size_t alignedSize = IMAGE_ALIGN(size);
+  if (self->dataSize + alignedSize > self->dataCapacity) {
+    size_t newCapacity = self->dataCapacity * 2;
+    while (self->dataSize + alignedSize > newCapacity)
+      newCapacity *= 2;
+
+    char* newData = realloc(self->data, newCapacity);
+    if (!newData)
+      return -ENOMEM;
+    self->data = newData;
+    self->dataCapacity = newCapacity;
+  }
+
+  char* payload = self->data + self->dataSize;
+  memcpy(payload, block->data, size);
+  memset(payload + size, 0, alignedSize - size);
+
+  self->table[objectIndex] = (struct image_object) {
+    .size = size,
+    .descriptor = descriptorIndex,
+    .dataOffset = self->dataSize
+  };
+  self->dataSize += alignedSize;
+
+  // Indices taken from the copy so object table and
+  // payload always agree even if fields were changed
+  __block int ret = 0;
+  forEachRefField(desc, size, ^(size_t offset) {
+    if (ret < 0)
+      return;
+
+    uint64_t index;
+    ret = visitObject(self, object_ref_decode(self->refBase, atomic_load_explicit(object_ref_field(payload, offset), memory_order_relaxed)), &index);
+    if (ret < 0)
+      return;
+    writeIndex(payload + offset, index);
+  });
+  return ret;
+}
+
+static int writeFile(const char* path, const struct image_header* header, struct saver* saver, const uint64_t* rootIndices) {
+  FILE* file = fopen(path, "wb");
+  if (!file)
+    return -errno;
+
+  // fwrite doesn't always set errno
+  int ret = 0;
+  errno = 0;
+  if (fwrite(header, sizeof(*header), 1, file) != 1 ||
+      fwrite(saver->table, sizeof(*saver->table), saver->objectCount, file) != saver->objectCount ||
+      fwrite(rootIndices, sizeof(*rootIndices), header->rootCount, file) != header->rootCount ||
+      fwrite(saver->data, 1, saver->dataSize, file) != saver->dataSize)
+    ret = errno ? -errno : -EIO;
+
+  if (fclose(file) != 0 && ret == 0)
+    ret = -errno;
+  return ret;
+}
+
+int heap_image_save(struct heap* self, const char* path, struct root_ref** roots, size_t rootCount, struct descriptor** descriptors, size_t descriptorCount) {
+  int ret = 0;
+  struct saver saver = {
+    .refBase = self->gen->allocTracker->refBase,
+    .objectCapacity = PTR_MAP_INITIAL_CAPACITY,
+    .dataCapacity = PTR_MAP_INITIAL_CAPACITY * 64
+  };
+
+  uint64_t* rootIndices = calloc(rootCount > 0 ? rootCount : 1, sizeof(*rootIndices));
+  saver.objects = malloc(saver.objectCapacity * sizeof(*saver.objects));
+  saver.table = malloc(saver.objectCapacity * sizeof(*saver.table));
+  saver.data = malloc(saver.dataCapacity);
+  bool mapsReady = ptrMapInit(&saver.objectIndices, PTR_MAP_INITIAL_CAPACITY) &&
+                   ptrMapInit(&saver.descriptorIndices, PTR_MAP_INITIAL_CAPACITY);
+  if (!rootIndices || !saver.objects || !saver.table || !saver.data || !mapsReady) {
+    ret = -ENOMEM;
+    goto failure;
+  }
+
+  for (size_t i = 0; i < descriptorCount; i++) {
+    if (!ptrMapPut(&saver.descriptorIndices, descriptors[i], i + 1)) {
+      ret = -ENOMEM;
+      goto failure;
+    }
+  }
+
+  // Objects can't be freed while GC blocked, every objects
+  // gets copied before unblocking so writing file don't
+  // hold GC up
+  heap_block_gc(self);
+  for (size_t i = 0; i < rootCount && ret == 0; i++)
+    ret = visitObject(&saver, roots[i]->obj, &rootIndices[i]);
+
+  // Breadth first, saving an object appends its
+  // unvisited referents
+  for (size_t i = 0; i < saver.objectCount && ret == 0; i++)
+    ret = saveObject(&saver, i);
+  heap_unblock_gc(self);
+  if (ret < 0)
+    goto failure;
+
+  struct image_header header = {
+    .magic = IMAGE_MAGIC,
+    .version = IMAGE_VERSION,
+    .refSize = sizeof(object_ref),
+    .objectCount = saver.objectCount,
+    .rootCount = rootCount,
+    .descriptorCount = descriptorCount,
+    .dataSize = saver.dataSize
+  };
+
+  ret = writeFile(path, &header, &saver, rootIndices);
+  if (ret < 0)
+    pr_error("Cannot write heap image to '%s': %s", path, strerror(-ret));
+  else
+    pr_info("Saved %zu objects (%zu bytes of data) into '%s'", saver.objectCount, saver.dataSize, path);
+
+failure:
+  ptrMapCleanup(&saver.objectIndices);
+  ptrMapCleanup(&saver.descriptorIndices);
+  free(saver.objects);
+  free(saver.table);
+  free(saver.data);
+  free(rootIndices);
+  return ret;
+}
+
+// Checks everything except references, those checked
+// while relocating
+static int validateImage(const void* image, size_t imageSize, size_t rootCount, struct descriptor** descriptors, size_t descriptorCount) {
+  struct image_header header;
+  if (imageSize < sizeof(header))
+    return -EINVAL;
+  memcpy(&header, image, sizeof(header));
+
+  if (memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0 || header.version != IMAGE_VERSION) {
+    pr_error("Not a heap image or unsupported version");
+    return -EINVAL;
+  }
+
+  if (header.refSize != sizeof(object_ref)) {
+    pr_error("Image saved with %u bytes references but this build uses %zu bytes", header.refSize, sizeof(object_ref));
+    return -EINVAL;
+  }
+
+  if (header.rootCount != rootCount || header.descriptorCount > descriptorCount) {
+    pr_error("Image expects %llu roots and %llu descriptors but given %zu roots and %zu descriptors", (unsigned long long) header.rootCount, (unsigned long long) header.descriptorCount, rootCount, descriptorCount);
+    return -EINVAL;
+  }
+
+  // Check each part fits without overflowing
+  size_t remaining = imageSize - sizeof(header);
+  if (header.objectCount > remaining / sizeof(struct image_object))
+    return -EINVAL;
+  remaining -= header.objectCount * sizeof(struct image_object);
+  if (header.rootCount > remaining / sizeof(uint64_t))
+    return -EINVAL;
+  remaining -= header.rootCount * sizeof(uint64_t);
+  if (header.dataSize > remaining)
+    return -EINVAL;
+
+  const struct image_object* objects = (const void*) ((const char*) image + sizeof(header));
+  for (uint64_t i = 0; i < header.objectCount; i++) {
+    const struct image_object* object = &objects[i];
+    if (object->dataOffset > header.dataSize || object->size > header.dataSize - object->dataOffset)
+      return -EINVAL;
+    if (object->descriptor > header.descriptorCount)
+      return -EINVAL;
+    if (object->descriptor != 0 && object->size < descriptors[object->descriptor - 1]->objectSize)
+      return -EINVAL;
+  }
+
+  const uint64_t* rootIndices = (const void*) (objects + header.objectCount);
+  for (uint64_t i = 0; i < header.rootCount; i++)
+    if (rootIndices[i] > header.objectCount)
+      return -EINVAL;
+  return 0;
+}
+
+int heap_image_load(struct heap* self, const char* path, struct root_ref** roots, size_t rootCount, struct descriptor** descriptors, size_t descriptorCount) {
+  const void* image;
+  size_t imageSize;
+  int ret = platform_map_file(path, &image, &imageSize);
+  if (ret < 0) {
+    pr_error("Cannot map heap image '%s': %s", path, strerror(-ret));
+    return ret;
+  }
+
+  struct alloc_unit** blocks = NULL;
+  size_t preallocatedCount = 0;
+
+  if ((ret = validateImage(image, imageSize, rootCount, descriptors, descriptorCount)) < 0) {
+    pr_error("Invalid heap image '%s'", path);
+    goto invalid_image;
+  }
+
+  struct image_header header;
+  memcpy(&header, image, sizeof(header));
+  const struct image_object* objects = (const void*) ((const char*) image + sizeof(header));
+  const uint64_t* rootIndices = (const void*) (objects + header.objectCount);
+  const char* data = (const char*) (rootIndices + header.rootCount);
+
+#ifdef CONFIG_OBJECT_COMPACT_HEADER
+  for (uint64_t i = 0; i < header.descriptorCount; i++) {
+    if (descriptor_get_index(descriptors[i]) < 0) {
+      pr_error("Descriptor table is full, can't load heap image");
+      ret = -ENOSPC;
+      goto invalid_image;
+    }
+  }
+#endif
+
+  struct thread* thread = heap_get_current_thread(self);
+  blocks = malloc((header.objectCount > 0 ? header.objectCount : 1) * sizeof(*blocks));
+  if (!blocks) {
+    ret = -ENOMEM;
+    goto invalid_image;
+  }
+
+  for (preallocatedCount = 0; preallocatedCount < rootCount; preallocatedCount++) {
+    if (!(roots[preallocatedCount] = thread_prealloc_root_ref(thread))) {
+      ret = -ENOMEM;
+      goto invalid_image;
+    }
+  }
+
+  // Loaded objects are unreachable until root refs created at
+  // the end, so holder keeps them alive letting GC run between
+  // chunks. Failure leaves already allocated ones as garbage
+  struct root_ref* holder = heap_alloc_with_descriptor(self, &holderDescriptor, header.objectCount * sizeof(object_ref));
+  if (!holder) {
+    pr_error("Heap ran out of memory while loading image '%s'", path);
+    ret = -ENOMEM;
+    goto invalid_image;
+  }
+
+  void* refBase = self->gen->allocTracker->refBase;
+  for (uint64_t chunkStart = 0; chunkStart < header.objectCount; chunkStart += IMAGE_LOAD_CHUNK_OBJECTS) {
+    uint64_t chunkEnd = header.objectCount - chunkStart > IMAGE_LOAD_CHUNK_OBJECTS ? chunkStart + IMAGE_LOAD_CHUNK_OBJECTS : header.objectCount;
+
+    heap_block_gc(self);
+    for (uint64_t i = chunkStart; i < chunkEnd; i++) {
+      struct descriptor* desc = objects[i].descriptor ? descriptors[objects[i].descriptor - 1] : NULL;
+      size_t size = objects[i].size;
+      __block struct alloc_unit* block = NULL;
+      heap_retry_alloc_blocked(self, ^bool (void) {
+        return (block = generation_alloc(self->gen, desc, size)) != NULL;
+      });
+
+      if (!block) {
+        heap_unblock_gc(self);
+        pr_error("Heap ran out of memory while loading image '%s'", path);
+        ret = -ENOMEM;
+        goto load_failure;
+      }
+      gc_on_allocate(block, self->gen);
+
+      // Recycled block comes with descriptor set, GC must see it
+      // as having no references until its payload relocated
+      alloc_unit_set_descriptor(block, NULL);
+      object_ref_store(refBase, holder->obj->data, i * sizeof(object_ref), block);
+      blocks[i] = block;
+    }
+    heap_unblock_gc(self);
+  }
+
+  // Every objects already reachable through holder, so references
+  // written here never point to objects GC may miss
+  for (uint64_t chunkStart = 0; chunkStart < header.objectCount; chunkStart += IMAGE_LOAD_CHUNK_OBJECTS) {
+    uint64_t chunkEnd = header.objectCount - chunkStart > IMAGE_LOAD_CHUNK_OBJECTS ? chunkStart + IMAGE_LOAD_CHUNK_OBJECTS : header.objectCount;
+
+    heap_block_gc(self);
+    for (uint64_t i = chunkStart; i < chunkEnd; i++) {
+      struct descriptor* desc = objects[i].descriptor ? descriptors[objects[i].descriptor - 1] : NULL;
+      const char* payload = data + objects[i].dataOffset;
+      memcpy(blocks[i]->data, payload, objects[i].size);
+
+      __block int relocateRet = 0;
+      struct alloc_unit** relocated = blocks;
+      uint64_t objectCount = header.objectCount;
+      struct alloc_unit* block = blocks[i];
+      forEachRefField(desc, objects[i].size, ^(size_t offset) {
+        uint64_t index = readIndex(payload + offset);
+        if (index > objectCount) {
+          relocateRet = -EINVAL;
+          return;
+        }
+        object_ref_store(refBase, block->data, offset, index ? relocated[index - 1] : NULL);
+      });
+
+      // Without descriptor GC sees it having no references
+      // so broken objects are left that way
+      if (relocateRet < 0) {
+        heap_unblock_gc(self);
+        pr_error("Invalid reference in heap image '%s'", path);
+        ret = relocateRet;
+        goto load_failure;
+      }
+
+      if (desc)
+        alloc_unit_set_descriptor(blocks[i], desc);
+    }
+    heap_unblock_gc(self);
+  }
+
+  heap_block_gc(self);
+  for (size_t i = 0; i < rootCount; i++)
+    thread_new_root_ref_from_prealloc_no_gc_block(thread, roots[i], rootIndices[i] ? blocks[rootIndices[i] - 1] : NULL);
+  heap_unblock_gc(self);
+  heap_root_unref(self, holder);
+
+  pr_info("Loaded %llu objects from '%s'", (unsigned long long) header.objectCount, path);
+  free(blocks);
+  platform_unmap_file(image, imageSize);
+  return 0;
+
+load_failure:
+  heap_root_unref(self, holder);
+invalid_image:
+  for (size_t i = 0; i < preallocatedCount; i++)
+    free(roots[i]);
+  free(blocks);
+  platform_unmap_file(image, imageSize);
+  return ret;
+}
@@ -0,0 +1,33 @@
+#ifndef UWU_EC240DDB_C44B_4C76_8209_E4D08BFE1922_UWU
+#define UWU_EC240DDB_C44B_4C76_8209_E4D08BFE1922_UWU
+
+#include <stddef.h>
+
+#include "heap/heap.h"
+
+// Heap images, snapshot of object graph reachable from
+// set of root refs saved into a file which can be loaded
+// back later faster than building the graph again
+//
+// Descriptors can't be saved so caller gives table of
+// descriptors and image refers to them by index in it,
+// loading must use table with same descriptors in same
+// order. Weak and soft fields saved like strong ones
+//
+// Images are only portable between builds with same
+// reference encoding (see object/ref.h)
+
+// Objects must not be modified while saving. Returns 0 or
+// -EINVAL if object has descriptor not in the table,
+// -ENOMEM or -errno if file can't be written
+int heap_image_save(struct heap* self, const char* path, struct root_ref** roots, size_t rootCount, struct descriptor** descriptors, size_t descriptorCount);
+
+// Objects are allocated as live in GC's perspective and root
+// refs to the roots are written to "roots", "rootCount" must
+// be the same as when saving. Returns 0 or -EINVAL if image
+// is invalid or doesn't match, -ENOMEM or -errno if file can't
+// be read. Loaded in chunks so GC can run in between, and heap
+// full while loading collects like normal allocation
+int heap_image_load(struct heap* self, const char* path, struct root_ref** roots, size_t rootCount, struct descriptor** descriptors, size_t descriptorCount);
+
+#endif
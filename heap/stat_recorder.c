@@ -0,0 +1,141 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <flup/core/logger.h>
+#include <flup/core/panic.h>
+#include <flup/thread/thread.h>
+
+#include "stat_recorder.h"
+#include "gc/driver.h"
+#include "gc/gc.h"
+#include "heap/generation.h"
+#include "heap/heap.h"
+#include "memory/alloc_tracker.h"
+
+#undef FLUP_LOG_CATEGORY
+#define FLUP_LOG_CATEGORY "Stat Recorder"
+
+// Rows are small, so this holds few seconds worth of
+// samples and writes are rare
+#define STAT_RECORDER_BUFFER_SIZE (64 * 1024)
+
+static double secondsBetween(const struct timespec* start, const struct timespec* end) {
+  return (double) (end->tv_sec - start->tv_sec) + (double) (end->tv_nsec - start->tv_nsec) / 1'000'000'000.0;
+}
+
+static void recordSample(struct stat_recorder* self) {
+  struct generation* gen = self->heap->gen;
+  struct gc_per_generation_state* gcState = gen->gcState;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  size_t bytesAllocated = atomic_load_explicit(&gen->allocTracker->lifetimeBytesAllocated, memory_order_relaxed);
+  double interval = secondsBetween(&self->previousTime, &now);
+  double allocRate = interval > 0.0 ? (double) (bytesAllocated - self->previousBytesAllocated) / interval : 0.0;
+  self->previousTime = now;
+  self->previousBytesAllocated = bytesAllocated;
+
+  struct gc_stats stats;
+  gc_get_stats(gcState, &stats);
+
+  fprintf(self->file, "%.6f,%zu,%zu,%.0f,%zu,%zu,%d,%llu,%llu,%.6f,%u,%.6f\n",
+    secondsBetween(&self->startTime, &now),
+    alloc_tracker_get_usage(gen->allocTracker),
+    gen->allocTracker->maxSize,
+    allocRate,
+    atomic_load_explicit(&gcState->liveSetSize, memory_order_relaxed),
+    atomic_load_explicit(&gcState->driver->averagePeakMemoryBeforeCycle, memory_order_relaxed),
+    atomic_load_explicit(&gcState->cycleInProgress, memory_order_relaxed) ? 1 : 0,
+    (unsigned long long) stats.lifetimeCyclesStartCount,
+    (unsigned long long) stats.lifetimeCyclesCompletedCount,
+    stats.lifetimeSTWTime,
+    atomic_load_explicit(&gcState->pacingMicrosec, memory_order_relaxed),
+    stats.lifetimePacingTime
+  );
+}
+
+static void recorderThread(void* _self) {
+  struct stat_recorder* self = _self;
+
+  struct timespec deadline;
+  if (clock_gettime(CLOCK_MONOTONIC, &deadline) != 0)
+    flup_panic("Strange this implementation did not support CLOCK_MONOTONIC");
+
+  long intervalNanosec = 1'000'000'000 / (long) self->rateHz;
+  while (!atomic_load(&self->quitRequested)) {
+    recordSample(self);
+
+    // Absolute deadline so time spent sampling
+    // don't drift the rate
+    deadline.tv_nsec += intervalNanosec;
+    while (deadline.tv_nsec >= 1'000'000'000) {
+      deadline.tv_nsec -= 1'000'000'000;
+      deadline.tv_sec++;
+    }
+
+    int ret = 0;
+    while ((ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)) == EINTR)
+      ;
+
+    if (ret != 0)
+      flup_panic("clock_nanosleep failed: %d", ret);
+  }
+
+  // Last one so the file covers until the end
+  recordSample(self);
+}
+
+struct stat_recorder* stat_recorder_new(struct heap* heap, const char* path, unsigned int rateHz) {
+  struct stat_recorder* self = malloc(sizeof(*self));
+  if (!self)
+    return NULL;
+
+  *self = (struct stat_recorder) {
+    .heap = heap,
+    .rateHz = rateHz > 0 ? rateHz : STAT_RECORDER_DEFAULT_RATE_HZ,
+    .previousBytesAllocated = atomic_load(&heap->gen->allocTracker->lifetimeBytesAllocated)
+  };
+
+  if (!(self->file = fopen(path, "w"))) {
+    pr_error("Cannot open '%s' for recording stats: %s", path, strerror(errno));
+    goto failure;
+  }
+  setvbuf(self->file, NULL, _IOFBF, STAT_RECORDER_BUFFER_SIZE);
+
+  fputs("time_sec,used_bytes,max_bytes,alloc_rate_bytes_per_sec,live_set_bytes,trigger_bytes,"
+        "cycle_in_progress,cycles_started,cycles_completed,stw_time_sec,pacing_delay_usec,pacing_time_sec\n", self->file);
+
+  clock_gettime(CLOCK_MONOTONIC, &self->startTime);
+  self->previousTime = self->startTime;
+
+  if (!(self->thread = flup_thread_new(recorderThread, self)))
+    goto failure;
+
+  pr_info("Recording stats into '%s' at %u Hz", path, self->rateHz);
+  return self;
+
+failure:
+  stat_recorder_free(self);
+  return NULL;
+}
+
+void stat_recorder_free(struct stat_recorder* self) {
+  if (!self)
+    return;
+
+  if (self->thread) {
+    atomic_store(&self->quitRequested, true);
+    flup_thread_wait(self->thread);
+    flup_thread_free(self->thread);
+  }
+
+  if (self->file)
+    fclose(self->file);
+  free(self);
+}
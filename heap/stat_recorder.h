@@ -0,0 +1,54 @@
+#ifndef UWU_2DF9A5DE_BDDA_40BF_9979_2508A44B878C_UWU
+#define UWU_2DF9A5DE_BDDA_40BF_9979_2508A44B878C_UWU
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <flup/thread/thread.h>
+
+#include "heap/heap.h"
+
+// Headless recorder which samples heap and GC stats at fixed
+// rate into CSV file, one row per sample. Its thread only reads
+// counters which never block mutators or GC, and rows written
+// through large stdio buffer
+//
+// Columns:
+// time_sec                 Seconds since recorder started
+// used_bytes               Heap usage
+// max_bytes                Heap size
+// alloc_rate_bytes_per_sec Bytes allocated since previous sample per second
+// live_set_bytes           Live set size from last cycle
+// trigger_bytes            Usage where driver expects to start cycle
+// cycle_in_progress        1 if GC cycle running
+// cycles_started           Lifetime cycle count
+// cycles_completed         Lifetime completed cycle count
+// stw_time_sec             Lifetime time in pauses
+// pacing_delay_usec        Current delay given to allocations
+// pacing_time_sec          Lifetime time mutators slept for pacing
+
+#define STAT_RECORDER_DEFAULT_RATE_HZ (20)
+
+struct stat_recorder {
+  struct heap* heap;
+  FILE* file;
+  unsigned int rateHz;
+
+  struct timespec startTime;
+  struct timespec previousTime;
+  size_t previousBytesAllocated;
+
+  atomic_bool quitRequested;
+  flup_thread* thread;
+};
+
+// Returns NULL if file can't be created or out of memory, "rateHz"
+// of 0 uses STAT_RECORDER_DEFAULT_RATE_HZ. Must be freed before heap
+struct stat_recorder* stat_recorder_new(struct heap* heap, const char* path, unsigned int rateHz);
+
+// Stops recording and flushes the file
+void stat_recorder_free(struct stat_recorder* self);
+
+#endif
@@ -1,15 +1,18 @@
+#include <errno.h>
 #include <stdlib.h>
 
+#include <flup/bug.h>
 #include <flup/data_structs/list_head.h>
 
 #include "gc/gc.h"
 #include "gc/gc_lock.h"
+#include "gc/remark_buffer.h"
 #include "heap/heap.h"
 #include "memory/alloc_tracker.h"
 #include "thread.h"
 
 struct thread* thread_new(struct heap* owner) {
-  struct thread* self = malloc(sizeof(*self) + sizeof(void*) * THREAD_LOCAL_REMARK_BUFFER_SIZE);
+  struct thread* self = malloc(sizeof(*self));
   if (!self)
     return NULL;
   
@@ -18,13 +21,18 @@ struct thread* thread_new(struct heap* owner) {
     .rootEntries = FLUP_LIST_HEAD_INIT(self->rootEntries),
     .cachedRootEntries = FLUP_LIST_HEAD_INIT(self->cachedRootEntries),
     .rootSize = 0,
-    .localRemarkBufferUsage = 0
+    .currentRootEntries = &self->rootEntries
   };
   
   if (!(self->allocContext = alloc_tracker_new_context(self->ownerHeap->gen->allocTracker)))
     goto failure;
   if (!(self->gcLockPerThread = gc_lock_new_thread(owner->gen->gcState->gcLock)))
     goto failure;
+  if (!(self->remarkBuffer = remark_buffer_pool_get(owner->gen->gcState->remarkBufferPool)))
+    goto failure;
+  
+  if (owner->gen->gcState->allocProfiler)
+    alloc_profiler_init_thread_state(owner->gen->gcState->allocProfiler, &self->allocProfilerState);
   return self;
 
 failure:
@@ -32,16 +40,62 @@ failure:
   return NULL;
 }
 
+void thread_detach(struct thread* self) {
+  struct gc_lock_state* gcLock = self->ownerHeap->gen->gcState->gcLock;
+  
+  // Context outlives the thread until sweeper done with its
+  // blocks. GC may free recycled lists in a pause so trimming
+  // them must not overlap with it
+  gc_lock_block_gc(gcLock, self->gcLockPerThread);
+  alloc_tracker_detach_context(self->ownerHeap->gen->allocTracker, self->allocContext);
+  self->allocContext = NULL;
+  gc_lock_unblock_gc(gcLock, self->gcLockPerThread);
+  
+  // GC must not wait for this thread from now
+  gc_lock_free_thread(gcLock, self->gcLockPerThread);
+  self->gcLockPerThread = NULL;
+  
+  atomic_store_explicit(&self->detached, true, memory_order_release);
+}
+
 void thread_free(struct thread* self) {
   if (!self)
     return;
   
-  gc_lock_free_thread(self->ownerHeap->gen->gcState->gcLock, self->gcLockPerThread);
-  flup_list_head* current;
-  flup_list_head* next;
-  flup_list_for_each_safe(&self->rootEntries, current, next)
-    thread_unref_root_no_gc_block(self, flup_list_entry(current, struct root_ref, node));
-  alloc_tracker_free_context(self->ownerHeap->gen->allocTracker, self->allocContext);
+  if (self->gcLockPerThread)
+    gc_lock_free_thread(self->ownerHeap->gen->gcState->gcLock, self->gcLockPerThread);
+  
+  // Detached thread's roots were already dropped from GC's
+  // view and freeing may happen on other thread, so don't remark
+  bool isDetached = atomic_load_explicit(&self->detached, memory_order_acquire);
+  thread_for_each_root_ref(self, ^(struct root_ref* ref) {
+    if (isDetached) {
+      flup_list_del(&ref->node);
+      free(ref);
+      return;
+    }
+    thread_unref_root_no_gc_block(self, ref);
+  });
+  
+  while (self->topFrame) {
+    struct root_frame* frame = self->topFrame;
+    self->topFrame = frame->prev;
+    free(frame);
+  }
+  while (self->cachedFrames) {
+    struct root_frame* frame = self->cachedFrames;
+    self->cachedFrames = frame->prev;
+    free(frame);
+  }
+  
+  // Don't lose pending entries, GC will process them
+  if (self->remarkBuffer && self->remarkBuffer->usage > 0)
+    remark_buffer_pool_submit(self->ownerHeap->gen->gcState->remarkBufferPool, self->remarkBuffer);
+  else if (self->remarkBuffer)
+    remark_buffer_pool_put(self->ownerHeap->gen->gcState->remarkBufferPool, self->remarkBuffer);
+  
+  if (self->allocContext)
+    alloc_tracker_free_context(self->ownerHeap->gen->allocTracker, self->allocContext);
   free(self);
 }
 
@@ -64,6 +118,50 @@ void thread_unref_root_no_gc_block(struct thread* self, struct root_ref* ref) {
   flup_list_add_head(&self->cachedRootEntries, &ref->node);
 }
 
+static void iterateRootList(flup_list_head* list, void (^iterator)(struct root_ref* ref)) {
+  flup_list_head* current;
+  flup_list_head* next;
+  flup_list_for_each_safe(list, current, next)
+    iterator(flup_list_entry(current, struct root_ref, node));
+}
+
+void thread_for_each_root_ref(struct thread* self, void (^iterator)(struct root_ref* ref)) {
+  iterateRootList(&self->rootEntries, iterator);
+  for (struct root_frame* frame = self->topFrame; frame; frame = frame->prev)
+    iterateRootList(&frame->rootEntries, iterator);
+}
+
+int thread_push_frame_no_gc_block(struct thread* self) {
+  struct root_frame* frame = self->cachedFrames;
+  if (frame)
+    self->cachedFrames = frame->prev;
+  else if (!(frame = malloc(sizeof(*frame))))
+    return -ENOMEM;
+  
+  *frame = (struct root_frame) {
+    .prev = self->topFrame,
+    .rootEntries = FLUP_LIST_HEAD_INIT(frame->rootEntries)
+  };
+  self->topFrame = frame;
+  self->currentRootEntries = &frame->rootEntries;
+  return 0;
+}
+
+void thread_pop_frame_no_gc_block(struct thread* self) {
+  struct root_frame* frame = self->topFrame;
+  BUG_ON(!frame);
+  
+  iterateRootList(&frame->rootEntries, ^(struct root_ref* ref) {
+    thread_unref_root_no_gc_block(self, ref);
+  });
+  
+  self->topFrame = frame->prev;
+  self->currentRootEntries = self->topFrame ? &self->topFrame->rootEntries : &self->rootEntries;
+  
+  frame->prev = self->cachedFrames;
+  self->cachedFrames = frame;
+}
+
 // Preallocation
 struct root_ref* thread_prealloc_root_ref(struct thread* self) {
   // Check if cache has it
@@ -79,7 +177,7 @@ struct root_ref* thread_prealloc_root_ref(struct thread* self) {
 void thread_new_root_ref_from_prealloc_no_gc_block(struct thread* self, struct root_ref* prealloc, struct alloc_unit* block) {
   prealloc->obj = block;
   self->rootSize++;
-  flup_list_add_head(&self->rootEntries, &prealloc->node);
+  flup_list_add_head(self->currentRootEntries, &prealloc->node);
 }
 
 
@@ -2,43 +2,78 @@
 #define UWU_F495C647_28BD_4F8C_8ACD_4E67362B2722_UWU
 
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include <flup/concurrency/mutex.h>
 #include <flup/data_structs/list_head.h>
 
+#include "gc/alloc_profiler.h"
 #include "gc/gc_lock.h"
 #include "memory/alloc_context.h"
 #include "memory/alloc_tracker.h"
+#include "util/rcu.h"
 
-// Mutator will only ever push this amount of bytes
-// into global queue
-#define THREAD_LOCAL_REMARK_BUFFER_SIZE ((1 * 1024 * 1024) / sizeof(void*))
+// Local frame of root refs, every root refs created
+// while the frame on top released when popped
+struct root_frame {
+  struct root_frame* prev;
+  flup_list_head rootEntries;
+};
 
 struct thread {
-  flup_list_head node;
+  // In heap's thread list, readers walk it without lock
+  struct rcu_list_node node;
+  struct rcu_head rcuHead;
+  
+  // Set by thread_detach, GC unlinks and frees the
+  // thread later as it may be in middle of a pause
+  atomic_bool detached;
   
   struct heap* ownerHeap;
   
+  // Root refs created outside any frame
   flup_list_head rootEntries;
   size_t rootSize;
   
+  // Where new root refs go, either rootEntries
+  // or the list in topFrame
+  flup_list_head* currentRootEntries;
+  struct root_frame* topFrame;
+  
+  // Popped frames for reuse, linked by "prev"
+  struct root_frame* cachedFrames;
+  
   struct alloc_context* allocContext;
   struct gc_lock_per_thread_data* gcLockPerThread;
   
   flup_list_head cachedRootEntries;
   
-  // Local remark buffer to reduce cost of inserting into global
-  // mark queue
-  unsigned int localRemarkBufferUsage;
-  struct alloc_unit* localRemarkBuffer[];
+  // Current remark buffer, handed to GC once full
+  struct remark_buffer* remarkBuffer;
+  
+  // Unused if allocation profiler disabled
+  struct alloc_profiler_thread_state allocProfilerState;
 };
 
 struct thread* thread_new(struct heap* owner);
 void thread_free(struct thread* self);
 
+// Called by the thread itself when leaving the heap, releases
+// things only owner can and leave the rest for GC. Don't touch
+// the heap with this thread after
+void thread_detach(struct thread* self);
+
 struct root_ref* thread_new_root_ref_no_gc_block(struct thread* self, struct alloc_unit* block);
 void thread_unref_root_no_gc_block(struct thread* self, struct root_ref* ref);
 
+// Iterate every root refs including ones in frames
+// "iterator" may unref the root ref it was given
+void thread_for_each_root_ref(struct thread* self, void (^iterator)(struct root_ref* ref));
+
+// Return -ENOMEM if can't allocate the frame
+int thread_push_frame_no_gc_block(struct thread* self);
+void thread_pop_frame_no_gc_block(struct thread* self);
+
 // Preallocation
 struct root_ref* thread_prealloc_root_ref(struct thread* self);
 void thread_new_root_ref_from_prealloc_no_gc_block(struct thread* self, struct root_ref* prealloc, struct alloc_unit* block);
@@ -1,10 +1,12 @@
 #include <mimalloc.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 
 #include <flup/concurrency/mutex.h>
 
 #include "alloc_tracker.h"
 #include "alloc_context.h"
+#include "object/descriptor.h"
 
 struct alloc_context* alloc_context_new(mi_arena_id_t arena) {
   struct alloc_context* ctx = malloc(sizeof(*ctx));
@@ -29,9 +31,64 @@ void alloc_context_add_block(struct alloc_context* self, struct alloc_unit* bloc
   self->allocListTail = block;
 }
 
-void alloc_context_free(struct alloc_tracker* self, struct alloc_context* ctx) {
-  if (!self)
-    return;
+static bool tryRecycle(struct alloc_context* self, struct alloc_unit* block) {
+  if (atomic_load_explicit(&self->owner->recycledTypeCount, memory_order_relaxed) == 0)
+    return false;
+  
+  struct descriptor* desc = alloc_unit_get_descriptor(block, memory_order_relaxed);
+  size_t size = alloc_unit_get_size(block);
+  int index = alloc_tracker_find_recycled_type(self->owner, desc, size);
+  if (index < 0 || self->recycledCounts[index] >= ALLOC_CONTEXT_MAX_RECYCLED_PER_TYPE)
+    return false;
+  
+  // Fields may still point to objects which freed already
+  // must be cleared before anyone could see it again
+  if (desc)
+    descriptor_init_object(desc, size - desc->objectSize, block->data);
+  
+  block->next = self->recycledLists[index];
+  self->recycledLists[index] = block;
+  self->recycledCounts[index]++;
+  return true;
+}
+
+bool alloc_context_drain_pending_free(struct alloc_context* self) {
+  struct alloc_unit* next = atomic_exchange_explicit(&self->pendingFree, NULL, memory_order_acquire);
+  if (!next)
+    return false;
+  
+  while (next) {
+    struct alloc_unit* current = next;
+    next = next->next;
+    if (tryRecycle(self, current))
+      continue;
+    mi_free_size(current, alloc_unit_get_size(current) + sizeof(*current));
+  }
+  return true;
+}
+
+void alloc_context_free_recycled(struct alloc_context* self) {
+  for (int i = 0; i < ALLOC_TRACKER_MAX_RECYCLED_TYPES; i++) {
+    struct alloc_unit* next = self->recycledLists[i];
+    while (next) {
+      struct alloc_unit* current = next;
+      next = next->next;
+      mi_free_size(current, alloc_unit_get_size(current) + sizeof(*current));
+    }
+    self->recycledLists[i] = NULL;
+    self->recycledCounts[i] = 0;
+  }
+}
+
+void alloc_context_trim(struct alloc_context* self) {
+  alloc_context_drain_pending_free(self);
+  alloc_context_free_recycled(self);
+  mi_heap_collect(self->mimallocHeap, true);
+}
+
+void alloc_context_release_blocks(struct alloc_tracker* self, struct alloc_context* ctx) {
+  alloc_context_drain_pending_free(ctx);
+  alloc_context_free_recycled(ctx);
   
   struct alloc_unit* next = ctx->allocListHead;
   while (next) {
@@ -41,6 +98,17 @@ void alloc_context_free(struct alloc_tracker* self, struct alloc_context* ctx) {
     alloc_tracker_add_block_to_global_list(self, current);
   }
   
+  // Sweeper hasn't got to this context's snapshot
+  // leave it for the sweeper
+  if (ctx->snapshotHead)
+    alloc_tracker_add_orphaned_snapshot(self, ctx->snapshotHead);
+  
+  ctx->allocListHead = NULL;
+  ctx->allocListTail = NULL;
+  ctx->snapshotHead = NULL;
+}
+
+void alloc_context_free(struct alloc_context* ctx) {
   free(ctx);
 }
 
@@ -2,11 +2,22 @@
 #define UWU_B8777715_D44C_4AC0_9BF5_A902F9366D3A_UWU
 
 #include <mimalloc.h>
+#include <stdatomic.h>
 #include <stddef.h>
 
 #include <flup/concurrency/mutex.h>
 #include <flup/data_structs/list_head.h>
 
+#include "util/rcu.h"
+
+// Maximum dead blocks kept per recycled type in each
+// context, rest are freed normally
+#define ALLOC_CONTEXT_MAX_RECYCLED_PER_TYPE 4096
+
+// Maximum number of recycled types, kept small as
+// every dead block is checked against all of them
+#define ALLOC_TRACKER_MAX_RECYCLED_TYPES 8
+
 struct alloc_tracker;
 struct alloc_tracker_snapshot;
 struct alloc_unit;
@@ -14,8 +25,17 @@ struct alloc_unit;
 struct alloc_context {
   struct alloc_tracker* owner;
   
-  flup_list_head node;
-  size_t preReservedUsage;
+  // In owner's contexts list, readers walk it without lock
+  struct rcu_list_node node;
+  struct rcu_head rcuHead;
+  
+  // Owner thread left, sweeper unlinks it after
+  // done with its blocks
+  atomic_bool detached;
+  
+  // Unused part of the grant from owner, only taken from by
+  // owner thread but tracker may take it back when heap is full
+  atomic_size_t preReservedUsage;
   
   mi_heap_t* mimallocHeap;
   
@@ -23,11 +43,45 @@ struct alloc_context {
   // of blocks one after another
   struct alloc_unit* allocListHead;
   struct alloc_unit* allocListTail;
+  
+  // Blocks which were allocated before current snapshot
+  // and not yet sweeped, protected by owner's listOfContextLock
+  struct alloc_unit* snapshotHead;
+  
+  // Index + 1 into sweeper's batch array while the sweeper
+  // working on this context's snapshot, protected by
+  // owner's listOfContextLock
+  size_t sweepSlot;
+  
+  // Dead blocks handed back by sweeper so they can be
+  // freed by owner thread instead of cross thread free
+  _Atomic(struct alloc_unit*) pendingFree;
+  
+  // Dead blocks of recycled types per type index,
+  // only touched by owner thread
+  struct alloc_unit* recycledLists[ALLOC_TRACKER_MAX_RECYCLED_TYPES];
+  size_t recycledCounts[ALLOC_TRACKER_MAX_RECYCLED_TYPES];
 };
 
 struct alloc_context* alloc_context_new(mi_arena_id_t arena);
-void alloc_context_free(struct alloc_tracker* self, struct alloc_context* ctx);
+void alloc_context_free(struct alloc_context* ctx);
+
+// Hand every blocks of context to the owner's lists, must be
+// called with owner's listOfContextLock held
+void alloc_context_release_blocks(struct alloc_tracker* self, struct alloc_context* ctx);
 
 void alloc_context_add_block(struct alloc_context* self, struct alloc_unit* block);
 
+// Free blocks which sweeper handed back, must be called by owner
+// thread. Return true if anything freed
+bool alloc_context_drain_pending_free(struct alloc_context* self);
+
+// Release recycled blocks and mimalloc's cached pages,
+// must be called by owner thread
+void alloc_context_trim(struct alloc_context* self);
+
+// Free recycled blocks, must be called by owner thread
+// or while owner can't allocate (in a pause)
+void alloc_context_free_recycled(struct alloc_context* self);
+
 #endif
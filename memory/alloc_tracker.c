@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <mimalloc.h>
 #include <stdatomic.h>
 #include <stdbool.h>
@@ -5,6 +6,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include <flup/bug.h>
 #include <flup/data_structs/list_head.h>
@@ -15,39 +17,169 @@
 
 #include "alloc_tracker.h"
 #include "memory/alloc_context.h"
+#include "object/ref.h"
+#include "platform/platform.h"
 
 #undef FLUP_LOG_CATEGORY
 #define FLUP_LOG_CATEGORY "Alloc Tracker"
 
+// mimalloc has no way to give up an arena it manages, it keeps
+// the arena registered after this. Memory mapped by the tracker
+// is still unmapped as the arena is exclusive so only this
+// tracker's heaps allocate from it and every block in it was
+// freed. Arena mimalloc reserved by itself (default pages)
+// can't be released at all
+static void releaseArena(struct alloc_tracker* self) {
+  if (!self->arenaStart || self->pageMode == PLATFORM_PAGE_DEFAULT)
+    return;
+  
+  // Purge scheduled on the freed pages must not happen after unmap
+  mi_collect(true);
+  platform_unmap_memory(self->arenaStart, self->arenaSize);
+  self->arenaStart = NULL;
+}
+
 static void freeMemories(struct alloc_tracker* self) {
+  releaseArena(self);
+  rcu_domain_free(self->contextsRcu);
   flup_mutex_free(self->listOfContextLock);
+  flup_mutex_free(self->exactLimitLock);
   free(self);
 }
 
-struct alloc_tracker* alloc_tracker_new(size_t size) {
+const char* alloc_tracker_page_mode_name(enum platform_page_mode mode) {
+  switch (mode) {
+    case PLATFORM_PAGE_DEFAULT:
+      return "default pages";
+    case PLATFORM_PAGE_TRANSPARENT_HUGE:
+      return "transparent huge pages";
+    case PLATFORM_PAGE_HUGE_2M:
+      return "2 MiB huge pages";
+    case PLATFORM_PAGE_HUGE_1G:
+      return "1 GiB huge pages";
+  }
+  return "unknown";
+}
+
+static size_t pageSizeOf(enum platform_page_mode mode) {
+  switch (mode) {
+    case PLATFORM_PAGE_HUGE_1G:
+      return 1024 * 1024 * 1024;
+    case PLATFORM_PAGE_HUGE_2M:
+    case PLATFORM_PAGE_TRANSPARENT_HUGE:
+      return 2 * 1024 * 1024;
+    case PLATFORM_PAGE_DEFAULT:
+      break;
+  }
+  return 1;
+}
+
+// Next mode to try if "mode" not available
+static enum platform_page_mode fallbackOf(enum platform_page_mode mode) {
+  switch (mode) {
+    case PLATFORM_PAGE_HUGE_1G:
+      return PLATFORM_PAGE_HUGE_2M;
+    case PLATFORM_PAGE_HUGE_2M:
+      return PLATFORM_PAGE_TRANSPARENT_HUGE;
+    case PLATFORM_PAGE_TRANSPARENT_HUGE:
+    case PLATFORM_PAGE_DEFAULT:
+      break;
+  }
+  return PLATFORM_PAGE_DEFAULT;
+}
+
+static int reserveArena(struct alloc_tracker* self, enum platform_page_mode mode) {
+  if (mode == PLATFORM_PAGE_DEFAULT) {
+    if (mi_reserve_os_memory_ex(
+      self->maxSize, 
+      false, 
+      false, 
+      true, 
+      &self->arena) != 0
+    )
+      return -ENOMEM;
+    
+    self->arenaStart = mi_arena_area(self->arena, &self->arenaSize);
+    return 0;
+  }
+  
+  size_t pageSize = pageSizeOf(mode);
+  size_t mapSize = (self->maxSize + pageSize - 1) / pageSize * pageSize;
+#ifdef CONFIG_OBJECT_COMPRESSED_REFS
+  // Rounding up to page size may push it over, smaller
+  // pages may still fit so let caller fall back
+  if (mapSize > OBJECT_REF_MAX_HEAP_SIZE)
+    return -E2BIG;
+#endif
+  
+  void* start;
+  int ret = platform_map_memory(mapSize, mode, &start);
+  if (ret < 0)
+    return ret;
+  
+  // Explicit huge pages are never swapped or split
+  bool isLarge = mode != PLATFORM_PAGE_TRANSPARENT_HUGE;
+  if (!mi_manage_os_memory_ex(start, mapSize, true, isLarge, true, -1, true, &self->arena)) {
+    platform_unmap_memory(start, mapSize);
+    return -ENOMEM;
+  }
+  
+  self->arenaStart = start;
+  self->arenaSize = mapSize;
+  return 0;
+}
+
+struct alloc_tracker* alloc_tracker_new(size_t size, enum platform_page_mode pageMode) {
   struct alloc_tracker* self = malloc(sizeof(*self));
   if (!self)
     return NULL;
   
   *self = (struct alloc_tracker) {
-    .currentUsage = 0,
+    .reservedUsage = 0,
     .maxSize = size,
-    .contexts = FLUP_LIST_HEAD_INIT(self->contexts)
+    .contexts = RCU_LIST_INIT
   };
   
-  if (mi_reserve_os_memory_ex(
-    size, 
-    false, 
-    false, 
-    true, 
-    &self->arena) != 0
-  ) {
-    pr_error("Failed to reserve memory for heap!");
+#ifdef CONFIG_OBJECT_COMPRESSED_REFS
+  if (size > OBJECT_REF_MAX_HEAP_SIZE) {
+    pr_error("Heap size %zu bytes is too large for compressed references (maximum %zu bytes)", size, OBJECT_REF_MAX_HEAP_SIZE);
+    free(self);
+    return NULL;
+  }
+#endif
+  
+  int ret;
+  while ((ret = reserveArena(self, pageMode)) < 0) {
+    if (pageMode == PLATFORM_PAGE_DEFAULT) {
+      pr_error("Failed to reserve memory for heap!");
+      goto failure;
+    }
+    
+    enum platform_page_mode fallback = fallbackOf(pageMode);
+    pr_warn("Cannot back heap with %s (%d), falling back to %s", alloc_tracker_page_mode_name(pageMode), ret, alloc_tracker_page_mode_name(fallback));
+    pageMode = fallback;
+  }
+  self->pageMode = pageMode;
+  pr_info("Heap backed by %s", alloc_tracker_page_mode_name(pageMode));
+  
+#ifdef CONFIG_OBJECT_COMPRESSED_REFS
+  // Mapped arenas are checked before mapping, but mimalloc
+  // rounds reserved one by itself so only known afterward.
+  // It never gives the reservation back but nothing was
+  // committed in it either
+  if (self->arenaSize > OBJECT_REF_MAX_HEAP_SIZE) {
+    pr_error("Heap arena (%zu bytes) is too large for compressed references", self->arenaSize);
     goto failure;
   }
+  self->refBase = (char*) self->arenaStart - OBJECT_REF_ALIGNMENT;
+#endif
   
   if (!(self->listOfContextLock = flup_mutex_new()))
     goto failure;
+  if (!(self->exactLimitLock = flup_mutex_new()))
+    goto failure;
+  if (!(self->contextsRcu = rcu_domain_new()))
+    goto failure;
   
   return self;
 
@@ -70,9 +202,17 @@ void alloc_tracker_free(struct alloc_tracker* self) {
   freeMemories(self);
 }
 
-void alloc_tracker_filter_snapshot_and_delete_snapshot(struct alloc_tracker* self, struct alloc_tracker_snapshot* snapshot, alloc_tracker_snapshot_filter_func filter) {
-  struct alloc_unit* next = snapshot->head;
-  size_t freedSize = 0;
+static void freeBlockList(struct alloc_unit* next) {
+  while (next) {
+    struct alloc_unit* current = next;
+    next = next->next;
+    mi_free_size(current, alloc_unit_get_size(current) + sizeof(*current));
+  }
+}
+
+// Return list of dead blocks, live ones moved to global list
+static struct alloc_unit* filterList(struct alloc_tracker* self, struct alloc_unit* next, alloc_tracker_snapshot_filter_func filter, size_t* freedSize) {
+  struct alloc_unit* deadHead = NULL;
   while (next) {
     struct alloc_unit* current = next;
     next = next->next;
@@ -82,14 +222,130 @@ void alloc_tracker_filter_snapshot_and_delete_snapshot(struct alloc_tracker* sel
       continue;
     }
     
-    size_t totalSize = current->size + sizeof(*current);
-    freedSize += totalSize;
-    mi_free_size(current, totalSize);
+    *freedSize += alloc_unit_get_size(current) + sizeof(*current);
+    current->next = deadHead;
+    deadHead = current;
   }
-  atomic_fetch_sub_explicit(&self->currentUsage, freedSize, memory_order_relaxed);
+  return deadHead;
+}
+
+struct sweep_batch {
+  struct alloc_unit* snapshotHead;
+  struct alloc_unit* deadHead;
+};
+
+static void reclaimContext(struct rcu_head* head) {
+  alloc_context_free(rcu_list_entry(head, struct alloc_context, rcuHead));
+}
+
+// Must be called with listOfContextLock held
+static void unlinkContext(struct alloc_tracker* self, struct alloc_context* ctx) {
+  alloc_context_release_blocks(self, ctx);
+  rcu_list_del(&self->contexts, &ctx->node);
+  rcu_retire(self->contextsRcu, &ctx->rcuHead, reclaimContext);
+}
+
+// Detached contexts' snapshot already sweeped by now, blocks
+// allocated after snapshot go to global list for next cycle
+static void reapDetachedContexts(struct alloc_tracker* self) {
+  struct rcu_list_node* current = atomic_load_explicit(&self->contexts.head, memory_order_relaxed);
+  while (current) {
+    struct rcu_list_node* next = atomic_load_explicit(&current->next, memory_order_relaxed);
+    struct alloc_context* ctx = rcu_list_entry(current, struct alloc_context, node);
+    if (atomic_load_explicit(&ctx->detached, memory_order_acquire))
+      unlinkContext(self, ctx);
+    current = next;
+  }
+}
+
+void alloc_tracker_filter_snapshot_and_delete_snapshot(struct alloc_tracker* self, struct alloc_tracker_snapshot* snapshot, alloc_tracker_snapshot_filter_func filter) {
+  size_t freedSize = 0;
+  
+  // Steal every contexts' snapshot list, contexts may come and
+  // go while sweeping so each context remembers its slot
+  flup_mutex_lock(self->listOfContextLock);
+  size_t batchCount = 0;
+  struct rcu_list_node* current;
+  rcu_list_for_each(&self->contexts, current)
+    batchCount++;
+  
+  struct sweep_batch* batches = malloc(sizeof(*batches) * (batchCount > 0 ? batchCount : 1));
+  if (!batches) {
+    // Not enough memory to track who owns which, just
+    // free everything directly from here
+    rcu_list_for_each(&self->contexts, current) {
+      struct alloc_context* ctx = rcu_list_entry(current, struct alloc_context, node);
+      freeBlockList(filterList(self, ctx->snapshotHead, filter, &freedSize));
+      ctx->snapshotHead = NULL;
+    }
+    flup_mutex_unlock(self->listOfContextLock);
+    goto sweep_global_list;
+  }
+  
+  size_t index = 0;
+  rcu_list_for_each(&self->contexts, current) {
+    struct alloc_context* ctx = rcu_list_entry(current, struct alloc_context, node);
+    batches[index] = (struct sweep_batch) {
+      .snapshotHead = ctx->snapshotHead
+    };
+    ctx->snapshotHead = NULL;
+    ctx->sweepSlot = index + 1;
+    index++;
+  }
+  flup_mutex_unlock(self->listOfContextLock);
+  
+  for (size_t i = 0; i < batchCount; i++)
+    batches[i].deadHead = filterList(self, batches[i].snapshotHead, filter, &freedSize);
+  
+  // Hand the dead blocks to contexts which still exists
+  flup_mutex_lock(self->listOfContextLock);
+  rcu_list_for_each(&self->contexts, current) {
+    struct alloc_context* ctx = rcu_list_entry(current, struct alloc_context, node);
+    if (ctx->sweepSlot == 0)
+      continue;
+    
+    struct sweep_batch* batch = &batches[ctx->sweepSlot - 1];
+    ctx->sweepSlot = 0;
+    
+    // Owner left, nobody would drain it
+    if (atomic_load_explicit(&ctx->detached, memory_order_acquire))
+      continue;
+    
+    // Owner didn't drain previous batch yet, free it
+    // here so memory don't pile up on idle threads
+    freeBlockList(atomic_exchange_explicit(&ctx->pendingFree, batch->deadHead, memory_order_release));
+    batch->deadHead = NULL;
+  }
+  flup_mutex_unlock(self->listOfContextLock);
+  
+  // Owners of these are gone
+  for (size_t i = 0; i < batchCount; i++)
+    freeBlockList(batches[i].deadHead);
+  free(batches);
+
+sweep_global_list:
+  flup_mutex_lock(self->listOfContextLock);
+  reapDetachedContexts(self);
+  struct alloc_unit* orphaned = self->orphanedSnapshotHead;
+  self->orphanedSnapshotHead = NULL;
+  flup_mutex_unlock(self->listOfContextLock);
+  
+  freeBlockList(filterList(self, orphaned, filter, &freedSize));
+  freeBlockList(filterList(self, snapshot->head, filter, &freedSize));
+  
+  atomic_fetch_sub_explicit(&self->reservedUsage, freedSize, memory_order_relaxed);
   snapshot->head = NULL;
 }
 
+void alloc_tracker_add_orphaned_snapshot(struct alloc_tracker* self, struct alloc_unit* head) {
+  struct alloc_unit* tail = head;
+  while (tail->next)
+    tail = tail->next;
+  
+  tail->next = self->orphanedSnapshotHead;
+  self->orphanedSnapshotHead = head;
+}
+
 void alloc_tracker_add_block_to_global_list(struct alloc_tracker* self, struct alloc_unit* block) {
   struct alloc_unit* oldHead = atomic_load_explicit(&self->head, memory_order_relaxed);
   do {
@@ -98,52 +354,113 @@ void alloc_tracker_add_block_to_global_list(struct alloc_tracker* self, struct a
 }
 
 
-static bool slowDoLargeAccounting(struct alloc_tracker* self, struct alloc_context*, size_t accountSize) {
-  size_t oldSize = atomic_load_explicit(&self->currentUsage, memory_order_relaxed);
+static bool tryReserve(struct alloc_tracker* self, size_t accountSize, size_t limit) {
+  size_t oldSize = atomic_load_explicit(&self->reservedUsage, memory_order_relaxed);
   size_t newSize;
   do {
-    if (oldSize + accountSize > self->maxSize)
+    if (oldSize + accountSize > limit)
       return false;
     
     newSize = oldSize + accountSize;
-  } while (!atomic_compare_exchange_weak_explicit(&self->currentUsage, &oldSize, newSize, memory_order_release, memory_order_relaxed));
+  } while (!atomic_compare_exchange_weak_explicit(&self->reservedUsage, &oldSize, newSize, memory_order_release, memory_order_relaxed));
   atomic_fetch_add_explicit(&self->lifetimeBytesAllocated, accountSize, memory_order_relaxed);
   return true;
 }
 
-static bool fastDoSmallAccounting(struct alloc_tracker* self, struct alloc_context* ctx, size_t allocSize) {
-  if (allocSize <= ctx->preReservedUsage)
-    goto fast_accounted;
+static size_t sumUnusedGrants(struct alloc_tracker* self) {
+  unsigned int rcuIndex = rcu_read_enter(self->contextsRcu);
+  size_t unusedGrants = 0;
+  struct rcu_list_node* current;
+  rcu_list_for_each(&self->contexts, current)
+    unusedGrants += atomic_load_explicit(&rcu_list_entry(current, struct alloc_context, node)->preReservedUsage, memory_order_relaxed);
+  rcu_read_exit(self->contextsRcu, rcuIndex);
+  return unusedGrants;
+}
+
+// Other contexts' unused grants are counted in "reservedUsage"
+// but may be lots of free memory with many threads, so take
+// them back before failing. Owners then have to reserve again
+// through "reservedUsage", so real usage stays under the limit
+static void revokeGrants(struct alloc_tracker* self) {
+  unsigned int rcuIndex = rcu_read_enter(self->contextsRcu);
+  struct rcu_list_node* current;
+  rcu_list_for_each(&self->contexts, current) {
+    struct alloc_context* ctx = rcu_list_entry(current, struct alloc_context, node);
+    size_t grant = atomic_exchange_explicit(&ctx->preReservedUsage, 0, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&self->reservedUsage, grant, memory_order_relaxed);
+  }
+  rcu_read_exit(self->contextsRcu, rcuIndex);
+}
+
+// Serialized so concurrent callers don't keep revoking
+// grants the other just gave back
+static bool doExactAccounting(struct alloc_tracker* self, size_t accountSize) {
+  if (tryReserve(self, accountSize, self->maxSize))
+    return true;
   
-  if (!slowDoLargeAccounting(self, ctx, CONTEXT_COUNTER_PRERESERVE_SIZE))
-    return false;
+  flup_mutex_lock(self->exactLimitLock);
+  revokeGrants(self);
+  bool success = tryReserve(self, accountSize, self->maxSize);
+  flup_mutex_unlock(self->exactLimitLock);
+  return success;
+}
+
+enum accounting_result {
+  ACCOUNTING_FAILED,
+  // Taken from context's grant
+  ACCOUNTING_FROM_GRANT,
+  // Reserved straight from "reservedUsage"
+  ACCOUNTING_EXACT
+};
+
+static enum accounting_result doAccounting(struct alloc_tracker* self, struct alloc_context* ctx, size_t allocSize) {
+  // Owner is the only one taking from it but others
+  // may revoke it, so don't overwrite it blindly
+  size_t grant = atomic_load_explicit(&ctx->preReservedUsage, memory_order_relaxed);
+  while (allocSize <= grant)
+    if (atomic_compare_exchange_weak_explicit(&ctx->preReservedUsage, &grant, grant - allocSize, memory_order_relaxed, memory_order_relaxed))
+      return ACCOUNTING_FROM_GRANT;
   
-  ctx->preReservedUsage += CONTEXT_COUNTER_PRERESERVE_SIZE;
-fast_accounted:
-  ctx->preReservedUsage -= allocSize;
-  return true;
+  if (allocSize < CONTEXT_COUNTER_PRERESERVE_SKIP && tryReserve(self, CONTEXT_COUNTER_PRERESERVE_SIZE, self->maxSize)) {
+    // Good time to free what sweeper handed back
+    alloc_context_drain_pending_free(ctx);
+    atomic_fetch_add_explicit(&ctx->preReservedUsage, CONTEXT_COUNTER_PRERESERVE_SIZE - allocSize, memory_order_relaxed);
+    return ACCOUNTING_FROM_GRANT;
+  }
+  
+  // Large allocation or heap too full to grant
+  // whole chunk, reserve exactly what needed
+  if (doExactAccounting(self, allocSize))
+    return ACCOUNTING_EXACT;
+  return ACCOUNTING_FAILED;
+}
+
+static void undoAccounting(struct alloc_tracker* self, struct alloc_context* ctx, size_t allocSize, enum accounting_result result) {
+  if (result == ACCOUNTING_EXACT) {
+    atomic_fetch_sub_explicit(&self->reservedUsage, allocSize, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&self->lifetimeBytesAllocated, allocSize, memory_order_relaxed);
+    return;
+  }
+  
+  // Came from grant which still counted in "reservedUsage"
+  // and "lifetimeBytesAllocated", so give it back to grant
+  atomic_fetch_add_explicit(&ctx->preReservedUsage, allocSize, memory_order_relaxed);
 }
 
 struct alloc_unit* alloc_tracker_alloc(struct alloc_tracker* self, struct alloc_context* ctx, size_t allocSize) {
   struct alloc_unit* blockMetadata;
   
   blockMetadata = mi_heap_malloc(ctx->mimallocHeap, sizeof(*blockMetadata) + allocSize);
+  if (!blockMetadata && alloc_context_drain_pending_free(ctx))
+    blockMetadata = mi_heap_malloc(ctx->mimallocHeap, sizeof(*blockMetadata) + allocSize);
   if (!blockMetadata)
     return NULL;
 
-  *blockMetadata = (struct alloc_unit) {
-    .size = allocSize
-  };
+  alloc_unit_init(blockMetadata, allocSize);
   
   size_t totalSize = allocSize + sizeof(struct alloc_unit);
   
-  bool allocStatus;
-  if (allocSize < CONTEXT_COUNTER_PRERESERVE_SKIP)
-    allocStatus = fastDoSmallAccounting(self, ctx, totalSize);
-  else
-    allocStatus = slowDoLargeAccounting(self, ctx, totalSize);
-  
-  if (!allocStatus)
+  if (doAccounting(self, ctx, totalSize) == ACCOUNTING_FAILED)
     goto failure;
   
   alloc_context_add_block(ctx, blockMetadata);
@@ -154,49 +471,126 @@ failure:
   return NULL;
 }
 
-void alloc_tracker_take_snapshot(struct alloc_tracker* self, struct alloc_tracker_snapshot* snapshot) {
+int alloc_tracker_add_recycled_type(struct alloc_tracker* self, struct descriptor* desc, size_t size) {
+  int ret = 0;
   flup_mutex_lock(self->listOfContextLock);
-  *snapshot = (struct alloc_tracker_snapshot) {};
+  unsigned int count = atomic_load_explicit(&self->recycledTypeCount, memory_order_relaxed);
+  if (count >= ALLOC_TRACKER_MAX_RECYCLED_TYPES) {
+    ret = -ENOSPC;
+    goto type_table_full;
+  }
   
-  __block struct alloc_unit* currentTail = NULL;
-  auto appendToSnapshot = ^(struct alloc_unit* head, struct alloc_unit* tail) {
-    if (snapshot->head == NULL) {
-      // The head is null that mean its the first item, so lets set
-      // head to current
-      snapshot->head = head;
-    } else {
-      // The "head" not null which mean Foxie has to append current context's
-      // list of allocated units to the tail of current snapshot's "head"
-      
-      // BUG_ON for some sanity check if tail indeed tail
-      BUG_ON(currentTail->next != NULL);
-      currentTail->next = head;
-    }
-    
-    // Another BUG_ON for some sanity check if tail indeed tail
-    BUG_ON(tail && tail->next != NULL);
-    
-    // Always set the tail to latest tail
-    currentTail = tail;
+  self->recycledTypes[count] = (struct alloc_tracker_recycled_type) {
+    .desc = desc,
+    .size = size
   };
+  atomic_store_explicit(&self->recycledTypeCount, count + 1, memory_order_release);
+type_table_full:
+  flup_mutex_unlock(self->listOfContextLock);
+  return ret;
+}
+
+int alloc_tracker_find_recycled_type(struct alloc_tracker* self, struct descriptor* desc, size_t size) {
+  unsigned int count = atomic_load_explicit(&self->recycledTypeCount, memory_order_acquire);
+  for (unsigned int i = 0; i < count; i++)
+    if (self->recycledTypes[i].desc == desc && self->recycledTypes[i].size == size)
+      return (int) i;
+  return -1;
+}
+
+struct alloc_unit* alloc_tracker_alloc_recycled(struct alloc_tracker* self, struct alloc_context* ctx, struct descriptor* desc, size_t allocSize) {
+  int index = alloc_tracker_find_recycled_type(self, desc, allocSize);
+  if (index < 0)
+    return NULL;
   
-  struct flup_list_head* current;
-  flup_list_for_each(&self->contexts, current) {
-    struct alloc_context* ctx = flup_list_entry(current, struct alloc_context, node);
-    if (!ctx->allocListHead)
-      goto skip_this_context;
-    appendToSnapshot(ctx->allocListHead, ctx->allocListTail);
+  if (!ctx->recycledLists[index])
+    return NULL;
+  
+  // Sweeper already took it out of accounting
+  size_t totalSize = allocSize + sizeof(struct alloc_unit);
+  enum accounting_result accounting = doAccounting(self, ctx, totalSize);
+  if (accounting == ACCOUNTING_FAILED)
+    return NULL;
+  
+  // Accounting may drain pending frees into the list or
+  // trim it, so only take the head after it and let caller
+  // fall back to fresh block if trimmed
+  struct alloc_unit* block = ctx->recycledLists[index];
+  if (!block) {
+    undoAccounting(self, ctx, totalSize, accounting);
+    return NULL;
+  }
+  
+  ctx->recycledLists[index] = block->next;
+  ctx->recycledCounts[index]--;
+  block->next = NULL;
+  alloc_context_add_block(ctx, block);
+  return block;
+}
+
+bool alloc_tracker_alloc_many(struct alloc_tracker* self, struct alloc_context* ctx, size_t count, size_t allocSize, struct alloc_unit** blocks) {
+  size_t totalSize = allocSize + sizeof(struct alloc_unit);
+  if (count == 0)
+    return true;
+  if (totalSize < allocSize || count > SIZE_MAX / totalSize)
+    return false;
+  
+  // Account every blocks at once
+  size_t accountSize = totalSize * count;
+  enum accounting_result accounting = doAccounting(self, ctx, accountSize);
+  if (accounting == ACCOUNTING_FAILED)
+    return false;
+  
+  size_t allocatedCount;
+  for (allocatedCount = 0; allocatedCount < count; allocatedCount++) {
+    struct alloc_unit* block = mi_heap_malloc(ctx->mimallocHeap, totalSize);
+    if (!block && alloc_context_drain_pending_free(ctx))
+      block = mi_heap_malloc(ctx->mimallocHeap, totalSize);
+    if (!block)
+      goto failure;
+    
+    alloc_unit_init(block, allocSize);
+    blocks[allocatedCount] = block;
+  }
+  
+  // Only add to the list once everything succeeded
+  // so failure don't need to unlink anything
+  for (size_t i = 0; i < count; i++)
+    alloc_context_add_block(ctx, blocks[i]);
+  return true;
+
+failure:
+  for (size_t i = 0; i < allocatedCount; i++)
+    mi_free_size(blocks[i], totalSize);
+  
+  undoAccounting(self, ctx, accountSize, accounting);
+  return false;
+}
+
+// Done in a pause, so contexts list is walked without
+// lock to not wait for threads attaching or detaching
+void alloc_tracker_take_snapshot(struct alloc_tracker* self, struct alloc_tracker_snapshot* snapshot) {
+  unsigned int rcuIndex = rcu_read_enter(self->contextsRcu);
+  *snapshot = (struct alloc_tracker_snapshot) {};
+  
+  struct rcu_list_node* current;
+  rcu_list_for_each(&self->contexts, current) {
+    struct alloc_context* ctx = rcu_list_entry(current, struct alloc_context, node);
+    
+    // Previous snapshot must be fully sweeped
+    BUG_ON(ctx->snapshotHead != NULL);
     
-    // Emptying the list in context as those invalid now
+    // Keep it in context so sweeper knows the owner, and
+    // emptying the list in context as those invalid now
+    ctx->snapshotHead = ctx->allocListHead;
     ctx->allocListHead = NULL;
     ctx->allocListTail = NULL;
-skip_this_context:
   }
   
-  // Append current global list
-  appendToSnapshot(atomic_exchange_explicit(&self->head, NULL, memory_order_relaxed), NULL);
+  // Take current global list
+  snapshot->head = atomic_exchange_explicit(&self->head, NULL, memory_order_relaxed);
   
-  flup_mutex_unlock(self->listOfContextLock);
+  rcu_read_exit(self->contextsRcu, rcuIndex);
 }
 
 struct alloc_context* alloc_tracker_new_context(struct alloc_tracker* self) {
@@ -206,15 +600,31 @@ struct alloc_context* alloc_tracker_new_context(struct alloc_tracker* self) {
   ctx->owner = self;
   
   flup_mutex_lock(self->listOfContextLock);
-  flup_list_add_head(&self->contexts, &ctx->node);
+  rcu_list_add_head(&self->contexts, &ctx->node);
   flup_mutex_unlock(self->listOfContextLock);
   return ctx;
 }
 
+static void markDetached(struct alloc_tracker* self, struct alloc_context* ctx) {
+  // Give back unused grant
+  size_t grant = atomic_exchange_explicit(&ctx->preReservedUsage, 0, memory_order_relaxed);
+  atomic_fetch_sub_explicit(&self->reservedUsage, grant, memory_order_relaxed);
+  
+  atomic_store_explicit(&ctx->detached, true, memory_order_release);
+}
+
+void alloc_tracker_detach_context(struct alloc_tracker* self, struct alloc_context* ctx) {
+  // Free what only owner may touch
+  alloc_context_trim(ctx);
+  markDetached(self, ctx);
+  rcu_poll(self->contextsRcu);
+}
+
 void alloc_tracker_free_context(struct alloc_tracker* self, struct alloc_context* ctx) {
+  markDetached(self, ctx);
+  
   flup_mutex_lock(self->listOfContextLock);
-  flup_list_del(&ctx->node);
-  alloc_context_free(self, ctx);
+  unlinkContext(self, ctx);
   flup_mutex_unlock(self->listOfContextLock);
 }
 
@@ -222,6 +632,46 @@ void alloc_tracker_get_statistics(struct alloc_tracker* self, struct alloc_track
   stat->maxSize = self->maxSize;
   stat->reservedBytes = stat->maxSize;
   stat->commitedBytes = stat->maxSize;
-  stat->usedBytes = atomic_load_explicit(&self->currentUsage, memory_order_relaxed);
+  stat->usedBytes = alloc_tracker_get_usage(self);
+  stat->pageMode = self->pageMode;
+}
+
+size_t alloc_tracker_get_usage(struct alloc_tracker* self) {
+  size_t reserved = atomic_load_explicit(&self->reservedUsage, memory_order_relaxed);
+  size_t unusedGrants = sumUnusedGrants(self);
+  
+  // Grants may be updated while summing
+  if (unusedGrants > reserved)
+    return 0;
+  return reserved - unusedGrants;
+}
+
+// Done in a pause, owners can't allocate so their
+// recycled lists can be freed from here
+void alloc_tracker_free_recycled(struct alloc_tracker* self) {
+  unsigned int rcuIndex = rcu_read_enter(self->contextsRcu);
+  struct rcu_list_node* current;
+  rcu_list_for_each(&self->contexts, current)
+    alloc_context_free_recycled(rcu_list_entry(current, struct alloc_context, node));
+  rcu_read_exit(self->contextsRcu, rcuIndex);
+}
+
+void alloc_tracker_trim(struct alloc_tracker* self) {
+  unsigned int rcuIndex = rcu_read_enter(self->contextsRcu);
+  struct rcu_list_node* current;
+  rcu_list_for_each(&self->contexts, current) {
+    struct alloc_context* ctx = rcu_list_entry(current, struct alloc_context, node);
+    
+    // Owner may be idle and never drain it, so
+    // free it from here
+    freeBlockList(atomic_exchange_explicit(&ctx->pendingFree, NULL, memory_order_acquire));
+  }
+  rcu_read_exit(self->contextsRcu, rcuIndex);
+  
+  // Mutators' heaps can't be collected from other thread as
+  // they share thread data with owner's default heap which may
+  // be in use. Blocks freed above go back to their pages as
+  // cross thread frees, this purges every arena's free pages
+  mi_collect(true);
 }
 
@@ -4,30 +4,50 @@
 #include <mimalloc.h>
 #include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 
+#include <flup/bug.h>
 #include <flup/data_structs/list_head.h>
 #include <flup/concurrency/mutex.h>
 
 #include "gc/gc.h"
 #include "object/descriptor.h"
+#include "platform/platform.h"
+#include "util/rcu.h"
 
 #include "alloc_context.h"
 
-// Takes "pre-reserve" the counter, and each context
-// check its counter usage. This meant to reduce contention
-// on global "currentUsage" atomic variable when multiple
-// threads intensively allocating.
+// Each context "pre-reserve" from global "reservedUsage" counter
+// and allocates from its own grant. This meant to reduce contention
+// on global atomic variable when multiple threads intensively
+// allocating.
 //
-// But the accounting is "currentUsage" reports 2 * <num threads> MiB
-// more used than actual usage 
+// Unused grants are subtracted when reading the usage (see
+// alloc_tracker_get_usage) so it stays exact, and once heap is
+// too full to grant whole chunk, exact size is reserved instead
+// after taking back every contexts' unused grant
 #define CONTEXT_COUNTER_PRERESERVE_SIZE (2 * 1024 * 1024)
 
 // Minimum size for allocation to skip the "pre-reserve"
 // mechanism and straight for slow one
 #define CONTEXT_COUNTER_PRERESERVE_SKIP (256 * 1024)
 
+// Dead blocks of recycled type reused instead of
+// being freed, must be registered before allocating
+struct alloc_tracker_recycled_type {
+  // NULL for objects without descriptor
+  struct descriptor* desc;
+  size_t size;
+};
+
 struct alloc_tracker {
-  atomic_size_t currentUsage;
+  // Bytes used plus every contexts' unused grant,
+  // never goes over maxSize
+  atomic_size_t reservedUsage;
+  
+  // Serializes exact reservations which take back
+  // unused grants when heap is full
+  flup_mutex* exactLimitLock;
   
   // Number of bytes ever allocated
   atomic_size_t lifetimeBytesAllocated;
@@ -40,13 +60,59 @@ struct alloc_tracker {
   //
   // this is where unsnapshot put blocks to
   _Atomic(struct alloc_unit*) head;
+  
+  // Snapshotted blocks from contexts which got freed
+  // before sweeper processed them, protected by
+  // listOfContextLock
+  struct alloc_unit* orphanedSnapshotHead;
     
+  // Serializes writers of "contexts", readers walk
+  // it under contextsRcu read side
   flup_mutex* listOfContextLock;
-  flup_list_head contexts;
+  struct rcu_list contexts;
+  struct rcu_domain* contextsRcu;
   
   mi_arena_id_t arena;
+  
+  // Where the arena is and how its backed
+  // which may differ from requested mode
+  void* arenaStart;
+  size_t arenaSize;
+  enum platform_page_mode pageMode;
+  
+  // Base for encoding reference fields (see object/ref.h)
+  // NULL if references aren't compressed
+  void* refBase;
+  
+  // Protected by listOfContextLock for writers
+  struct alloc_tracker_recycled_type recycledTypes[ALLOC_TRACKER_MAX_RECYCLED_TYPES];
+  atomic_uint recycledTypeCount;
 };
 
+#ifdef CONFIG_OBJECT_COMPACT_HEADER
+// Compact header packs everything except "next" into one word
+//
+// Bit 63     : Mark bit
+// Bit 62 - 48: Descriptor index (see descriptor_get_index)
+// Bit 47     : Sampled by allocation profiler
+// Bit 46 - 0 : Size
+//
+// Owning generation is found from address instead (see
+// generation_from_address)
+#define ALLOC_UNIT_MARK_BIT (1ull << 63)
+#define ALLOC_UNIT_DESC_SHIFT (48)
+#define ALLOC_UNIT_DESC_MASK ((uint64_t) DESCRIPTOR_MAX_INDEX << ALLOC_UNIT_DESC_SHIFT)
+#define ALLOC_UNIT_SAMPLED_BIT (1ull << 47)
+#define ALLOC_UNIT_SIZE_MASK ((1ull << 47) - 1)
+
+struct alloc_unit {
+  // If current->next == NULL then its end of detached head :3
+  struct alloc_unit* next;
+  _Atomic(uint64_t) header;
+  
+  char data[];
+};
+#else
 struct alloc_unit {
   // If current->next == NULL then its end of detached head :3
   struct alloc_unit* next;
@@ -61,9 +127,116 @@ struct alloc_unit {
   
   char data[];
 };
+#endif
+
+// Accessors for header fields so the rest don't care
+// which header layout is used
+
+static inline void alloc_unit_init(struct alloc_unit* self, size_t size) {
+#ifdef CONFIG_OBJECT_COMPACT_HEADER
+  BUG_ON(size > ALLOC_UNIT_SIZE_MASK);
+  *self = (struct alloc_unit) {
+    .header = size
+  };
+#else
+  *self = (struct alloc_unit) {
+    .size = size
+  };
+#endif
+}
+
+static inline size_t alloc_unit_get_size(struct alloc_unit* self) {
+#ifdef CONFIG_OBJECT_COMPACT_HEADER
+  return (size_t) (atomic_load_explicit(&self->header, memory_order_relaxed) & ALLOC_UNIT_SIZE_MASK);
+#else
+  return self->size;
+#endif
+}
+
+// Descriptor is set with release and read with acquire
+// by GC, "order" is what caller needs
+static inline struct descriptor* alloc_unit_get_descriptor(struct alloc_unit* self, memory_order order) {
+#ifdef CONFIG_OBJECT_COMPACT_HEADER
+  uint64_t header = atomic_load_explicit(&self->header, order);
+  return descriptor_from_index((unsigned int) ((header & ALLOC_UNIT_DESC_MASK) >> ALLOC_UNIT_DESC_SHIFT));
+#else
+  return atomic_load_explicit(&self->desc, order);
+#endif
+}
+
+// In compact mode "desc" must already have index
+// (see descriptor_get_index)
+static inline void alloc_unit_set_descriptor(struct alloc_unit* self, struct descriptor* desc) {
+#ifdef CONFIG_OBJECT_COMPACT_HEADER
+  uint64_t index = desc ? atomic_load_explicit(&desc->headerIndex, memory_order_acquire) : 0;
+  BUG_ON(desc && index == 0);
+  
+  // GC may be marking it at the same time
+  uint64_t header = atomic_load_explicit(&self->header, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(&self->header, &header, (header & ~ALLOC_UNIT_DESC_MASK) | (index << ALLOC_UNIT_DESC_SHIFT), memory_order_release, memory_order_relaxed))
+    ;
+#else
+  atomic_store_explicit(&self->desc, desc, memory_order_release);
+#endif
+}
+
+static inline bool alloc_unit_load_mark_bit(struct alloc_unit* self) {
+#ifdef CONFIG_OBJECT_COMPACT_HEADER
+  return (atomic_load_explicit(&self->header, memory_order_relaxed) & ALLOC_UNIT_MARK_BIT) != 0;
+#else
+  return atomic_load_explicit(&self->gcMetadata.markBit, memory_order_relaxed);
+#endif
+}
+
+// Returns previous value
+static inline bool alloc_unit_exchange_mark_bit(struct alloc_unit* self, bool value) {
+#ifdef CONFIG_OBJECT_COMPACT_HEADER
+  uint64_t prev;
+  if (value)
+    prev = atomic_fetch_or_explicit(&self->header, ALLOC_UNIT_MARK_BIT, memory_order_relaxed);
+  else
+    prev = atomic_fetch_and_explicit(&self->header, ~ALLOC_UNIT_MARK_BIT, memory_order_relaxed);
+  return (prev & ALLOC_UNIT_MARK_BIT) != 0;
+#else
+  return atomic_exchange_explicit(&self->gcMetadata.markBit, value, memory_order_relaxed);
+#endif
+}
+
+static inline void alloc_unit_store_mark_bit(struct alloc_unit* self, bool value) {
+#ifdef CONFIG_OBJECT_COMPACT_HEADER
+  alloc_unit_exchange_mark_bit(self, value);
+#else
+  atomic_store_explicit(&self->gcMetadata.markBit, value, memory_order_relaxed);
+#endif
+}
+
+// Tag for objects which allocation profiler keeps
+// track of (see gc/alloc_profiler.h)
+static inline bool alloc_unit_is_sampled(struct alloc_unit* self) {
+#ifdef CONFIG_OBJECT_COMPACT_HEADER
+  return (atomic_load_explicit(&self->header, memory_order_relaxed) & ALLOC_UNIT_SAMPLED_BIT) != 0;
+#else
+  return atomic_load_explicit(&self->gcMetadata.sampled, memory_order_relaxed);
+#endif
+}
+
+static inline void alloc_unit_set_sampled(struct alloc_unit* self, bool sampled) {
+#ifdef CONFIG_OBJECT_COMPACT_HEADER
+  if (sampled)
+    atomic_fetch_or_explicit(&self->header, ALLOC_UNIT_SAMPLED_BIT, memory_order_relaxed);
+  else
+    atomic_fetch_and_explicit(&self->header, ~ALLOC_UNIT_SAMPLED_BIT, memory_order_relaxed);
+#else
+  atomic_store_explicit(&self->gcMetadata.sampled, sampled, memory_order_relaxed);
+#endif
+}
 
 // Snapshot of list of heap objects
 // at the time of snapshot for GC traversal
+//
+// Blocks allocated by still existing contexts stays in
+// each context's "snapshotHead" so sweeper knows whose
+// blocks it is, "head" only contains global list
 struct alloc_tracker_snapshot {
   struct alloc_unit* head;
 };
@@ -74,24 +247,67 @@ struct alloc_tracker_statistic {
   size_t usedBytes;
   size_t reservedBytes;
   size_t commitedBytes;
+  enum platform_page_mode pageMode;
 };
 
 void alloc_tracker_get_statistics(struct alloc_tracker* self, struct alloc_tracker_statistic* stat);
 
+// Give memory cached by contexts and mimalloc back to OS, for
+// when heap is idle. Recycled blocks are freed separately by
+// alloc_tracker_free_recycled as it needs a pause, GC does both
+// in a cycle after gc_request_trim
+void alloc_tracker_trim(struct alloc_tracker* self);
+
+// Must be called in a pause
+void alloc_tracker_free_recycled(struct alloc_tracker* self);
+
+// Exact bytes used, sums up every contexts' unused grant
+// so don't call it in hot paths
+size_t alloc_tracker_get_usage(struct alloc_tracker* self);
+
 struct alloc_context* alloc_tracker_new_context(struct alloc_tracker* self);
 void alloc_tracker_free_context(struct alloc_tracker* self, struct alloc_context* ctx);
 
+// Called by owner thread when leaving, context is unlinked
+// and freed by sweeper later so this never waits for GC
+void alloc_tracker_detach_context(struct alloc_tracker* self, struct alloc_context* ctx);
+
 void alloc_tracker_take_snapshot(struct alloc_tracker* self, struct alloc_tracker_snapshot* snapshot);
 void alloc_tracker_add_block_to_global_list(struct alloc_tracker* self, struct alloc_unit* block);
 
+// Must be called with listOfContextLock held
+void alloc_tracker_add_orphaned_snapshot(struct alloc_tracker* self, struct alloc_unit* head);
+
 // Return true if the block going to be unsnapshotted
 // or false if not
+//
+// Dead blocks from each context handed back to the context
+// as one batch to be freed by owner thread, so the sweeper don't
+// do cross thread free for every block
 typedef bool (^alloc_tracker_snapshot_filter_func)(struct alloc_unit* blk);
 void alloc_tracker_filter_snapshot_and_delete_snapshot(struct alloc_tracker* self, struct alloc_tracker_snapshot* snapshot, alloc_tracker_snapshot_filter_func filter);
 
-struct alloc_tracker* alloc_tracker_new(size_t size);
+// Falls back to smaller pages and then to default
+// if requested "pageMode" can't be used
+struct alloc_tracker* alloc_tracker_new(size_t size, enum platform_page_mode pageMode);
+const char* alloc_tracker_page_mode_name(enum platform_page_mode mode);
 void alloc_tracker_free(struct alloc_tracker* self);
 
 struct alloc_unit* alloc_tracker_alloc(struct alloc_tracker* self, struct alloc_context* ctx, size_t size);
 
+// Return -ENOSPC if there too many recycled types
+int alloc_tracker_add_recycled_type(struct alloc_tracker* self, struct descriptor* desc, size_t size);
+
+// Return index of the recycled type or -1 if its not one
+int alloc_tracker_find_recycled_type(struct alloc_tracker* self, struct descriptor* desc, size_t size);
+
+// Reuse dead block of given type, NULL if there none. Returned
+// block has descriptor set and its fields already NULL-ed
+struct alloc_unit* alloc_tracker_alloc_recycled(struct alloc_tracker* self, struct alloc_context* ctx, struct descriptor* desc, size_t size);
+
+// Allocate "count" blocks of same size with single accounting
+// reservation, either all of them allocated and written into
+// "blocks" or none of them (and false returned)
+bool alloc_tracker_alloc_many(struct alloc_tracker* self, struct alloc_context* ctx, size_t count, size_t size, struct alloc_unit** blocks);
+
 #endif
@@ -1,22 +1,48 @@
+#include <errno.h>
 #include <stdatomic.h>
 #include <stddef.h>
 #include <string.h>
 
 #include "descriptor.h"
+#include "object/ref.h"
 
 void descriptor_init_object(struct descriptor* desc, size_t extraSize, void* data) {
-  for (size_t i = 0; i < desc->fieldCount; i++) {
-    _Atomic(struct arena_block*)* fieldPtr = (_Atomic(struct arena_block*)*) ((void*) (((char*) data) + desc->fields[i].offset));
-    atomic_store_explicit(fieldPtr, NULL, memory_order_relaxed);
-  }
+  // NULL encoded the same regardless of base
+  for (size_t i = 0; i < desc->fieldCount; i++)
+    object_ref_store(NULL, data, desc->fields[i].offset, NULL);
   
   if (!desc->hasFlexArrayField)
     return;
   
   // Initialize flexible array part
-  for (size_t i = 0; i < extraSize / sizeof(void*); i++) {
-    _Atomic(struct arena_block*)* fieldPtr = (_Atomic(struct arena_block*)*) ((void*) (((char*) data) + desc->objectSize + i * sizeof(void*)));
-    atomic_store_explicit(fieldPtr, NULL, memory_order_relaxed);
-  }
+  for (size_t i = 0; i < extraSize / sizeof(object_ref); i++)
+    object_ref_store(NULL, data, desc->objectSize + i * sizeof(object_ref), NULL);
 }
 
+
+#ifdef CONFIG_OBJECT_COMPACT_HEADER
+_Atomic(struct descriptor*) descriptor_index_table[DESCRIPTOR_MAX_INDEX + 1];
+static atomic_uint nextIndex = 1;
+
+int descriptor_get_index(struct descriptor* desc) {
+  unsigned int index = atomic_load_explicit(&desc->headerIndex, memory_order_acquire);
+  if (index != 0)
+    return (int) index;
+  
+  // Not atomic_fetch_add so a full table stays full
+  // instead of counter wrapping around eventually
+  unsigned int newIndex = atomic_load_explicit(&nextIndex, memory_order_relaxed);
+  do {
+    if (newIndex > DESCRIPTOR_MAX_INDEX)
+      return -ENOSPC;
+  } while (!atomic_compare_exchange_weak_explicit(&nextIndex, &newIndex, newIndex + 1, memory_order_relaxed, memory_order_relaxed));
+  
+  atomic_store_explicit(&descriptor_index_table[newIndex], desc, memory_order_relaxed);
+  
+  // Other thread may gave it an index first, then the
+  // one just taken is wasted which is fine as its rare
+  if (!atomic_compare_exchange_strong_explicit(&desc->headerIndex, &index, newIndex, memory_order_release, memory_order_acquire))
+    return (int) index;
+  return (int) newIndex;
+}
+#endif
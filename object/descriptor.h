@@ -1,6 +1,7 @@
 #ifndef UWU_A7F05A83_764D_4B35_915C_57321065BE4A_UWU
 #define UWU_A7F05A83_764D_4B35_915C_57321065BE4A_UWU
 
+#include <stdatomic.h>
 #include <stddef.h>
 
 #include <flup/util/refcount.h>
@@ -10,8 +11,26 @@
 // of GC system, while GC system only
 // queue the descriptor to be free'd
 
+enum field_strength {
+  // Normal reference, keeps referent alive
+  FIELD_STRONG = 0,
+  
+  // Doesn't keep referent alive, GC clears the field
+  // once referent is only reachable through weak/soft
+  // fields
+  FIELD_WEAK,
+  
+  // Same as weak but GC only clears it when heap is
+  // under memory pressure, otherwise its treated as
+  // strong reference. Nice for caches which can use
+  // spare heap space
+  FIELD_SOFT
+};
+
+// Referenced by offset of an object_ref (see object/ref.h)
 struct field {
   size_t offset;
+  enum field_strength strength;
 };
 
 struct descriptor {
@@ -19,11 +38,39 @@ struct descriptor {
   size_t fieldCount;
   
   // Intend to cover structures which has GC-able pointers
-  // in flexible array at the end of structs
+  // in flexible array at the end of structs (those are always
+  // strong references)
   bool hasFlexArrayField;
+  
+#ifdef CONFIG_OBJECT_COMPACT_HEADER
+  // Index in global descriptor table which compact header
+  // stores instead of pointer, 0 until first allocation
+  atomic_uint headerIndex;
+#endif
+  
   struct field fields[];
 };
 
 void descriptor_init_object(struct descriptor* desc, size_t extraSize, void* data);
 
+#ifdef CONFIG_OBJECT_COMPACT_HEADER
+// Index 0 stands for NULL descriptor
+#define DESCRIPTOR_INDEX_BITS (15)
+#define DESCRIPTOR_MAX_INDEX ((1u << DESCRIPTOR_INDEX_BITS) - 1)
+
+// Global so that any heap can decode the index without
+// knowing which heap object is from
+extern _Atomic(struct descriptor*) descriptor_index_table[DESCRIPTOR_MAX_INDEX + 1];
+
+// Gives "desc" an index if it doesn't have one yet, returns
+// the index or -ENOSPC if every indices are taken. Indices are
+// never given back so descriptor which freed and reused must
+// be zero initialized again to get new index
+int descriptor_get_index(struct descriptor* desc);
+
+static inline struct descriptor* descriptor_from_index(unsigned int index) {
+  return atomic_load_explicit(&descriptor_index_table[index], memory_order_relaxed);
+}
+#endif
+
 #endif
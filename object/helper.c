@@ -6,22 +6,34 @@
 #include "gc/gc.h"
 #include "memory/alloc_tracker.h"
 #include "helper.h"
+#include "heap/generation.h"
 #include "heap/heap.h"
+#include "object/ref.h"
 
 void object_helper_write_ref(struct heap* heap, struct alloc_unit* block, size_t offset, struct alloc_unit* newBlock) {
   heap_block_gc(heap);
-  _Atomic(struct alloc_unit*)* fieldPtr = (_Atomic(struct alloc_unit*)*) ((void*) (((char*) block->data) + offset));
-  gc_need_remark(atomic_exchange_explicit(fieldPtr, newBlock, memory_order_relaxed));
+  gc_need_remark(object_ref_exchange(heap->gen->allocTracker->refBase, block->data, offset, newBlock));
   heap_unblock_gc(heap);
 }
 
 struct root_ref* object_helper_read_ref(struct heap* heap, struct alloc_unit* block, size_t offset) {
   heap_block_gc(heap);
-  _Atomic(struct alloc_unit*)* fieldPtr = (_Atomic(struct alloc_unit*)*) ((void*) (((char*) block->data) + offset));
-  struct root_ref* new = heap_new_root_ref_unlocked(heap, atomic_load_explicit(fieldPtr, memory_order_relaxed));
+  struct root_ref* new = heap_new_root_ref_unlocked(heap, object_ref_load(heap->gen->allocTracker->refBase, block->data, offset));
   gc_need_remark(block);
   heap_unblock_gc(heap);
   return new;
 }
 
+struct root_ref* object_helper_read_weak_ref(struct heap* heap, struct alloc_unit* block, size_t offset) {
+  heap_block_gc(heap);
+  struct alloc_unit* referent = object_ref_load(heap->gen->allocTracker->refBase, block->data, offset);
+  struct root_ref* new = heap_new_root_ref_unlocked(heap, referent);
+  
+  // Referent might be only weakly reachable and GC still marking
+  // so mark it, else GC would clear and sweep it under our feet
+  gc_need_remark(referent);
+  heap_unblock_gc(heap);
+  return new;
+}
+
 
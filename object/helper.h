@@ -12,4 +12,8 @@
 void object_helper_write_ref(struct heap* heap, struct alloc_unit* block, size_t offset, struct alloc_unit* newBlock);
 struct root_ref* object_helper_read_ref(struct heap* heap, struct alloc_unit* block, size_t offset);
 
+// Must be used for reading FIELD_WEAK and FIELD_SOFT fields
+// so GC wont clear referent which mutator just got
+struct root_ref* object_helper_read_weak_ref(struct heap* heap, struct alloc_unit* block, size_t offset);
+
 #endif
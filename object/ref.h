@@ -0,0 +1,69 @@
+#ifndef UWU_AF2CCEF4_D8FC_4B45_B317_8519A37F30AA_UWU
+#define UWU_AF2CCEF4_D8FC_4B45_B317_8519A37F30AA_UWU
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Reference fields in objects. Either plain pointer or with
+// OBJECT_COMPRESSED_REFS, 32-bit offset from heap's "base"
+// shifted by OBJECT_REF_SHIFT where 0 is NULL. Fields must be
+// accessed through these so both works, "base" is refBase of
+// alloc_tracker which owns the object (unused for plain pointers)
+
+struct alloc_unit;
+
+#ifdef CONFIG_OBJECT_COMPRESSED_REFS
+typedef uint32_t object_ref;
+
+// Blocks from mimalloc are at least 8 bytes aligned
+#define OBJECT_REF_SHIFT (3)
+#define OBJECT_REF_ALIGNMENT ((size_t) 1 << OBJECT_REF_SHIFT)
+
+// Base is one unit before the heap so no block encoded
+// as 0, which leaves one unit less than 32 GiB
+#define OBJECT_REF_MAX_HEAP_SIZE (((size_t) UINT32_MAX) << OBJECT_REF_SHIFT)
+#else
+typedef struct alloc_unit* object_ref;
+#endif
+
+static inline object_ref object_ref_encode(void* base, struct alloc_unit* block) {
+#ifdef CONFIG_OBJECT_COMPRESSED_REFS
+  if (!block)
+    return 0;
+  return (object_ref) ((size_t) ((char*) block - (char*) base) >> OBJECT_REF_SHIFT);
+#else
+  (void) base;
+  return block;
+#endif
+}
+
+static inline struct alloc_unit* object_ref_decode(void* base, object_ref ref) {
+#ifdef CONFIG_OBJECT_COMPRESSED_REFS
+  if (ref == 0)
+    return NULL;
+  return (struct alloc_unit*) ((void*) ((char*) base + ((size_t) ref << OBJECT_REF_SHIFT)));
+#else
+  (void) base;
+  return ref;
+#endif
+}
+
+static inline _Atomic(object_ref)* object_ref_field(void* data, size_t offset) {
+  return (_Atomic(object_ref)*) ((void*) (((char*) data) + offset));
+}
+
+static inline struct alloc_unit* object_ref_load(void* base, void* data, size_t offset) {
+  return object_ref_decode(base, atomic_load_explicit(object_ref_field(data, offset), memory_order_relaxed));
+}
+
+static inline void object_ref_store(void* base, void* data, size_t offset, struct alloc_unit* block) {
+  atomic_store_explicit(object_ref_field(data, offset), object_ref_encode(base, block), memory_order_relaxed);
+}
+
+// Returns previous referent
+static inline struct alloc_unit* object_ref_exchange(void* base, void* data, size_t offset, struct alloc_unit* block) {
+  return object_ref_decode(base, atomic_exchange_explicit(object_ref_field(data, offset), object_ref_encode(base, block), memory_order_relaxed));
+}
+
+#endif
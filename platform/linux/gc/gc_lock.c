@@ -18,6 +18,7 @@
 #include <unistd.h>
 
 #include "gc/gc_lock.h"
+#include "util/rcu.h"
 
 // Adapted from http://concurrencyfreaks.blogspot.com/2013/01/scalable-and-fast-read-write-locks.html
 // and changed few things so there no limit on threads
@@ -52,7 +53,8 @@ enum gc_state : uint32_t {
 
 // Maps to each state in "readers_states" in that blog
 struct gc_lock_per_thread_data {
-  flup_list_head node;
+  struct rcu_list_node node;
+  struct rcu_head rcuHead;
   
   [[gnu::aligned(64)]]
   _Atomic(enum mutator_state) mutatorState;
@@ -60,10 +62,12 @@ struct gc_lock_per_thread_data {
 
 struct gc_lock_state {
   // Maps to "readers_states" in that blog but linked list
-  // instead bounded array
-  flup_list_head mutatorThreadsList;
+  // instead bounded array. GC walks it without lock so
+  // registering threads never waits for GC
+  struct rcu_list mutatorThreadsList;
+  struct rcu_domain* mutatorThreadsRcu;
   
-  // Protects the mutatorThreadsList
+  // Serializes writers of the mutatorThreadsList
   flup_mutex* mutatorThreadsListLock;
   
   // Maps to "write_state" in that blog
@@ -97,12 +101,14 @@ struct gc_lock_state* gc_lock_new() {
     return NULL;
   
   *self = (struct gc_lock_state) {
-    .mutatorThreadsList = FLUP_LIST_HEAD_INIT(self->mutatorThreadsList),
+    .mutatorThreadsList = RCU_LIST_INIT,
     .gcState = GC_UNUSED
   };
   
   if (!(self->mutatorThreadsListLock = flup_mutex_new()))
     goto failure;
+  if (!(self->mutatorThreadsRcu = rcu_domain_new()))
+    goto failure;
   return self;
 
 failure:
@@ -114,11 +120,10 @@ void gc_lock_free(struct gc_lock_state* self) {
   if (!self)
     return;
   
-  flup_mutex_lock(self->mutatorThreadsListLock);
-  if (!flup_list_is_empty(&self->mutatorThreadsList))
+  if (!rcu_list_is_empty(&self->mutatorThreadsList))
     flup_panic("Not all mutator stopped!");
-  flup_mutex_unlock(self->mutatorThreadsListLock);
   
+  rcu_domain_free(self->mutatorThreadsRcu);
   flup_mutex_free(self->mutatorThreadsListLock);
   free(self);
 }
@@ -132,17 +137,25 @@ struct gc_lock_per_thread_data* gc_lock_new_thread(struct gc_lock_state* self) {
     .mutatorState = MUTATOR_UNUSED
   };
   
+  // New thread is unused so GC which is already walking
+  // the list don't need to see it
   flup_mutex_lock(self->mutatorThreadsListLock);
-  flup_list_add_tail(&self->mutatorThreadsList, &thread->node);
+  rcu_list_add_head(&self->mutatorThreadsList, &thread->node);
   flup_mutex_unlock(self->mutatorThreadsListLock);
   return thread;
 }
 
+static void reclaimThread(struct rcu_head* head) {
+  free(rcu_list_entry(head, struct gc_lock_per_thread_data, rcuHead));
+}
+
+// GC might be still waiting on this thread's state
+// so freeing is deferred
 void gc_lock_free_thread(struct gc_lock_state* self, struct gc_lock_per_thread_data* thread) {
   flup_mutex_lock(self->mutatorThreadsListLock);
-  flup_list_del(&thread->node);
+  rcu_list_del(&self->mutatorThreadsList, &thread->node);
   flup_mutex_unlock(self->mutatorThreadsListLock);
-  free(thread);
+  rcu_retire(self->mutatorThreadsRcu, &thread->rcuHead, reclaimThread);
 }
 
 // The operations
@@ -155,10 +168,10 @@ void gc_lock_enter_gc_exclusive(struct gc_lock_state* self) {
   atomic_store_explicit(&self->gcState, GC_ACTIVE_OR_WAIT, memory_order_relaxed);
   
   // For each mutator, we'll wait until it turned either WAITING or UNUSED
-  flup_mutex_lock(self->mutatorThreadsListLock);
-  flup_list_head* current;
-  flup_list_for_each(&self->mutatorThreadsList, current) {
-    struct gc_lock_per_thread_data* thread = flup_list_entry(current, struct gc_lock_per_thread_data, node);
+  unsigned int rcuIndex = rcu_read_enter(self->mutatorThreadsRcu);
+  struct rcu_list_node* current;
+  rcu_list_for_each(&self->mutatorThreadsList, current) {
+    struct gc_lock_per_thread_data* thread = rcu_list_entry(current, struct gc_lock_per_thread_data, node);
     
     // I get this part from the hint
     // > Notice that the numerical value of RSTATE_PREP is larger than
@@ -169,7 +182,7 @@ void gc_lock_enter_gc_exclusive(struct gc_lock_state* self) {
     while (atomic_load_explicit(&thread->mutatorState, memory_order_relaxed) > MUTATOR_WAITING)
       futex_wait(&thread->mutatorState, MUTATOR_PREPARING);
   }
-  flup_mutex_unlock(self->mutatorThreadsListLock);
+  rcu_read_exit(self->mutatorThreadsRcu, rcuIndex);
 }
 
 void gc_lock_exit_gc_exclusive(struct gc_lock_state* self) {
@@ -203,4 +216,12 @@ void gc_lock_unblock_gc(struct gc_lock_state* self, struct gc_lock_per_thread_da
     futex_wake_one(&thread->mutatorState);
 }
 
+void gc_lock_enter_native(struct gc_lock_state*, struct gc_lock_per_thread_data*) {
+}
+
+void gc_lock_exit_native(struct gc_lock_state*, struct gc_lock_per_thread_data*) {
+}
+
+void gc_lock_poll(struct gc_lock_state*, struct gc_lock_per_thread_data*) {
+}
 
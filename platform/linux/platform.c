@@ -1,6 +1,242 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <execinfo.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
 #include "platform/platform.h"
 
+// From linux/mempolicy.h, so libnuma isn't needed
+#define LINUX_MPOL_F_NODE (1 << 0)
+#define LINUX_MPOL_F_ADDR (1 << 1)
+
+// Fallbacks for older headers
+#ifndef MAP_HUGE_SHIFT
+# define MAP_HUGE_SHIFT 26
+#endif
+#define LINUX_MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#define LINUX_MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+
+#define LINUX_THP_ALIGNMENT (2 * 1024 * 1024)
+
 const char* platform_get_name() {
   return "Linux";
 }
 
+static int parseCpuList(const char* cpuList, cpu_set_t* set) {
+  CPU_ZERO(set);
+  
+  const char* current = cpuList;
+  while (*current != '\0' && *current != '\n') {
+    char* end;
+    long first = strtol(current, &end, 10);
+    if (end == current || first < 0)
+      return -EINVAL;
+    
+    long last = first;
+    if (*end == '-') {
+      current = end + 1;
+      last = strtol(current, &end, 10);
+      if (end == current || last < first)
+        return -EINVAL;
+    }
+    
+    if (last >= CPU_SETSIZE)
+      return -EINVAL;
+    for (long cpu = first; cpu <= last; cpu++)
+      CPU_SET((int) cpu, set);
+    
+    current = end;
+    if (*current == ',')
+      current++;
+    else if (*current != '\0' && *current != '\n')
+      return -EINVAL;
+  }
+  
+  if (CPU_COUNT(set) == 0)
+    return -EINVAL;
+  return 0;
+}
+
+int platform_set_current_thread_affinity(const char* cpuList) {
+  cpu_set_t set;
+  int ret = parseCpuList(cpuList, &set);
+  if (ret < 0)
+    return ret;
+  
+  if (sched_setaffinity(0, sizeof(set), &set) != 0)
+    return -errno;
+  return 0;
+}
+
+int platform_set_current_thread_sched(enum platform_sched_policy policy, int nice) {
+  struct sched_param param = {
+    .sched_priority = 0
+  };
+  
+  // On Linux, sched_setscheduler and setpriority with
+  // thread ID only affects that thread
+  if (policy == PLATFORM_SCHED_IDLE) {
+    if (sched_setscheduler(0, SCHED_IDLE, &param) != 0)
+      return -errno;
+    return 0;
+  }
+  
+  if (sched_setscheduler(0, SCHED_OTHER, &param) != 0)
+    return -errno;
+  if (setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), nice) != 0)
+    return -errno;
+  return 0;
+}
+
+int platform_get_numa_node_cpu_list(int node, char* buffer, size_t bufferSize) {
+  char path[128];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+  
+  FILE* file = fopen(path, "r");
+  if (!file)
+    return -errno;
+  
+  int ret = 0;
+  if (!fgets(buffer, (int) bufferSize, file))
+    ret = -EIO;
+  fclose(file);
+  
+  if (ret == 0)
+    buffer[strcspn(buffer, "\n")] = '\0';
+  return ret;
+}
+
+int platform_get_numa_node_of_address(void* addr) {
+  int node = -1;
+  if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr, LINUX_MPOL_F_NODE | LINUX_MPOL_F_ADDR) != 0)
+    return -errno;
+  return node;
+}
+
+static int mapTransparentHuge(size_t size, void** result) {
+  // Over-map so start can be aligned to huge page size
+  // else the first and last few MiB can't be huge pages
+  size_t mapSize = size + LINUX_THP_ALIGNMENT;
+  char* mapped = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mapped == MAP_FAILED)
+    return -errno;
+  
+  char* aligned = (char*) (((uintptr_t) mapped + LINUX_THP_ALIGNMENT - 1) & ~((uintptr_t) LINUX_THP_ALIGNMENT - 1));
+  if (aligned != mapped)
+    munmap(mapped, (size_t) (aligned - mapped));
+  size_t tailSize = (size_t) ((mapped + mapSize) - (aligned + size));
+  if (tailSize > 0)
+    munmap(aligned + size, tailSize);
+  
+  if (madvise(aligned, size, MADV_HUGEPAGE) != 0) {
+    int err = errno;
+    munmap(aligned, size);
+    return -err;
+  }
+  
+  *result = aligned;
+  return 0;
+}
+
+int platform_map_memory(size_t size, enum platform_page_mode mode, void** result) {
+  int hugeFlags;
+  switch (mode) {
+    case PLATFORM_PAGE_TRANSPARENT_HUGE:
+      return mapTransparentHuge(size, result);
+    case PLATFORM_PAGE_HUGE_2M:
+      hugeFlags = MAP_HUGETLB | LINUX_MAP_HUGE_2MB;
+      break;
+    case PLATFORM_PAGE_HUGE_1G:
+      hugeFlags = MAP_HUGETLB | LINUX_MAP_HUGE_1GB;
+      break;
+    default:
+      return -EINVAL;
+  }
+  
+  // No MAP_NORESERVE, so mmap fails right away if hugetlb pool
+  // doesn't have enough pages instead of SIGBUS later
+  void* mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | hugeFlags, -1, 0);
+  if (mapped == MAP_FAILED)
+    return -errno;
+  
+  *result = mapped;
+  return 0;
+}
+
+void platform_unmap_memory(void* addr, size_t size) {
+  munmap(addr, size);
+}
+
+int platform_map_file(const char* path, const void** result, size_t* size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -errno;
+  
+  int ret = 0;
+  struct stat info;
+  if (fstat(fd, &info) < 0) {
+    ret = -errno;
+    goto failure;
+  }
+  
+  if (info.st_size <= 0) {
+    ret = -EINVAL;
+    goto failure;
+  }
+  
+  // Caller going to read all of it, fault it in at once
+  void* mapped = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  if (mapped == MAP_FAILED) {
+    ret = -errno;
+    goto failure;
+  }
+  
+  *result = mapped;
+  *size = (size_t) info.st_size;
+failure:
+  close(fd);
+  return ret;
+}
+
+void platform_unmap_file(const void* addr, size_t size) {
+  munmap((void*) addr, size);
+}
+
+int platform_capture_backtrace(void** frames, int maxFrames, int skip) {
+  // Capture into bigger buffer so frames can be skipped,
+  // this frame itself is also skipped
+  void* buffer[maxFrames + skip + 1];
+  int count = backtrace(buffer, maxFrames + skip + 1);
+  if (count <= skip + 1)
+    return 0;
+  
+  count -= skip + 1;
+  memcpy(frames, &buffer[skip + 1], sizeof(void*) * (size_t) count);
+  return count;
+}
+
+int platform_write_memory_map(FILE* output) {
+  FILE* maps = fopen("/proc/self/maps", "r");
+  if (!maps)
+    return -errno;
+  
+  char buffer[4096];
+  size_t readSize;
+  while ((readSize = fread(buffer, 1, sizeof(buffer), maps)) > 0)
+    fwrite(buffer, 1, readSize, output);
+  
+  int ret = ferror(maps) || ferror(output) ? -EIO : 0;
+  fclose(maps);
+  return ret;
+}
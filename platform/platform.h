@@ -1,6 +1,70 @@
 #ifndef UWU_C6CE65DA_7DE4_4A26_BEBB_C1DFE47208FE_UWU
 #define UWU_C6CE65DA_7DE4_4A26_BEBB_C1DFE47208FE_UWU
 
+#include <stddef.h>
+#include <stdio.h>
+
 const char* platform_get_name();
 
+// Thread placement and scheduling, all of these apply to
+// calling thread and returns 0 on success or -errno on
+// failure (-ENOSYS if platform doesn't support it)
+
+enum platform_sched_policy {
+  // Normal time sharing with given nice value
+  PLATFORM_SCHED_NORMAL,
+  
+  // Only run when CPU has nothing else to do
+  PLATFORM_SCHED_IDLE
+};
+
+// "cpuList" in Linux's cpulist format, for example "0-3,8,10-11"
+int platform_set_current_thread_affinity(const char* cpuList);
+
+// "nice" ignored for PLATFORM_SCHED_IDLE
+int platform_set_current_thread_sched(enum platform_sched_policy policy, int nice);
+
+// Write cpulist of NUMA node into "buffer"
+int platform_get_numa_node_cpu_list(int node, char* buffer, size_t bufferSize);
+
+// Returns NUMA node which backs the page at "addr"
+// (page must be already faulted in) or -errno
+int platform_get_numa_node_of_address(void* addr);
+
+// Memory backing modes for large reservations
+enum platform_page_mode {
+  // Let mimalloc reserve it with normal pages
+  PLATFORM_PAGE_DEFAULT,
+  
+  // Transparent huge pages with madvise(MADV_HUGEPAGE)
+  PLATFORM_PAGE_TRANSPARENT_HUGE,
+  
+  // Explicit huge pages (needs pages reserved
+  // in the system's hugetlb pool)
+  PLATFORM_PAGE_HUGE_2M,
+  PLATFORM_PAGE_HUGE_1G
+};
+
+// Map readable and writable memory with given mode, "size" must be
+// multiple of the page size of the mode. Returns 0 and the address
+// in "result" or -errno. PLATFORM_PAGE_DEFAULT is not accepted
+int platform_map_memory(size_t size, enum platform_page_mode mode, void** result);
+void platform_unmap_memory(void* addr, size_t size);
+
+// Map whole file at "path" read only, returns 0 and the
+// address and size in "result" and "size" or -errno. Empty
+// file can't be mapped (-EINVAL)
+int platform_map_file(const char* path, const void** result, size_t* size);
+void platform_unmap_file(const void* addr, size_t size);
+
+// Return addresses of calling thread's stack innermost first,
+// starting from the caller after skipping "skip" frames. Returns
+// number of frames written into "frames" or -errno
+int platform_capture_backtrace(void** frames, int maxFrames, int skip);
+
+// Write mappings of current process in /proc/self/maps format
+// so addresses from platform_capture_backtrace can be symbolized
+// later, returns 0 or -errno
+int platform_write_memory_map(FILE* output);
+
 #endif
@@ -1,6 +1,80 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "platform/platform.h"
 
 const char* platform_get_name() {
   return "POSIX";
 }
 
+// POSIX has no portable way to do these per thread
+
+int platform_set_current_thread_affinity(const char*) {
+  return -ENOSYS;
+}
+
+int platform_set_current_thread_sched(enum platform_sched_policy, int) {
+  return -ENOSYS;
+}
+
+int platform_get_numa_node_cpu_list(int, char*, size_t) {
+  return -ENOSYS;
+}
+
+int platform_get_numa_node_of_address(void*) {
+  return -ENOSYS;
+}
+
+int platform_map_memory(size_t, enum platform_page_mode, void**) {
+  return -ENOSYS;
+}
+
+void platform_unmap_memory(void*, size_t) {
+}
+
+int platform_map_file(const char* path, const void** result, size_t* size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -errno;
+  
+  int ret = 0;
+  struct stat info;
+  if (fstat(fd, &info) < 0) {
+    ret = -errno;
+    goto failure;
+  }
+  
+  if (info.st_size <= 0) {
+    ret = -EINVAL;
+    goto failure;
+  }
+  
+  void* mapped = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapped == MAP_FAILED) {
+    ret = -errno;
+    goto failure;
+  }
+  
+  *result = mapped;
+  *size = (size_t) info.st_size;
+failure:
+  close(fd);
+  return ret;
+}
+
+void platform_unmap_file(const void* addr, size_t size) {
+  munmap((void*) addr, size);
+}
+
+// No portable way to walk the stack
+int platform_capture_backtrace(void**, int, int) {
+  return -ENOSYS;
+}
+
+int platform_write_memory_map(FILE*) {
+  return -ENOSYS;
+}
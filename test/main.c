@@ -13,41 +13,52 @@
 #include <flup/thread/thread.h>
 
 #include "platform/platform.h"
+#include "gc/alloc_profiler.h"
+#include "gc/runtime.h"
 #include "heap/heap.h"
 #include "memory/alloc_tracker.h"
 #include "object/descriptor.h"
 #include "object/helper.h"
+#include "object/ref.h"
+#include "heap/stat_recorder.h"
+
+#ifdef CONFIG_TEST_SDL_STAT_PRINTER
 #include "stat_printer.h"
+#endif
 
 #define WINDOW_SIZE 200'000
 #define MESSAGE_COUNT 5'000'000
 // #define MESSAGE_SIZE  (6 * 1024 + 512) //(2 * 1024 + 512)
 #define MESSAGE_SIZE 1024
 
+#define SHARED_RUNTIME_HEAP_COUNT 2
+#define SHARED_RUNTIME_HEAP_SIZE (64 * 1024 * 1024)
+#define SHARED_RUNTIME_WINDOW_SIZE 10'000
+#define SHARED_RUNTIME_MESSAGE_COUNT 500'000
+
 struct array_of_messages {
   long length;
-  _Atomic(char*) messages[];
+  _Atomic(object_ref) messages[];
 };
 
 static int64_t worstTimeMicroSec = 0;
 static int64_t totalTimeMicroSec = 0;
 static int64_t sampleCount = 0;
 
-static struct root_ref* newMessage(struct heap* heap, int n) {
+static void newMessageInto(struct heap* heap, struct alloc_unit* parent, size_t offset, int n) {
   size_t size = MESSAGE_SIZE; //(size_t) ((float) rand() / (float) RAND_MAX * MESSAGE_SIZE);
   
-  struct root_ref* message = heap_alloc(heap, size);
-  memset(message->obj->data, n & 0xFF, size);
-  return message;
+  // Only this thread has access to the window
+  // so message stays alive while being filled
+  struct alloc_unit* message = heap_alloc_into(heap, parent, offset, size);
+  memset(message->data, n & 0xFF, size);
 }
 
 static void pushMessage(struct heap* heap, struct root_ref* window, int id) {
   struct timespec start, end;
   clock_gettime(CLOCK_REALTIME, &start);
   
-  struct root_ref* message = newMessage(heap, id);
-  object_helper_write_ref(heap, window->obj, offsetof(struct array_of_messages, messages[id % WINDOW_SIZE]), message->obj);
-  heap_root_unref(heap, message);
+  newMessageInto(heap, window->obj, offsetof(struct array_of_messages, messages[id % WINDOW_SIZE]), id);
   
   clock_gettime(CLOCK_REALTIME, &end);
   
@@ -68,7 +79,7 @@ static struct descriptor desc_array_of_messages = {
 };
 
 static void runTest(struct heap* heap, int iterations) {
-  struct root_ref* messagesWindow = heap_alloc_with_descriptor(heap, &desc_array_of_messages, WINDOW_SIZE * sizeof(void*));
+  struct root_ref* messagesWindow = heap_alloc_with_descriptor(heap, &desc_array_of_messages, WINDOW_SIZE * sizeof(object_ref));
   struct array_of_messages* deref = (void*) messagesWindow->obj->data;
   deref->length = WINDOW_SIZE;
   
@@ -106,7 +117,9 @@ static void runnerFunction(void* _heap) {
     flup_panic("Cannot attach thread!");
   
   // Wait for start sync
+  heap_enter_native(heap);
   pthread_barrier_wait(&runnerWaitBarrier);
+  heap_exit_native(heap);
   
   // Test based on same test on
   // https://github.com/WillSewell/gc-latency-experiment
@@ -120,10 +133,68 @@ static void runnerFunction(void* _heap) {
   // doTestGCExperiment(heap);
   
   // Wait for stop sync
+  heap_enter_native(heap);
   pthread_barrier_wait(&runnerWaitBarrier);
+  heap_exit_native(heap);
   heap_detach_thread(heap);
 }
 
+static void sharedRuntimeRunner(void* _heap) {
+  struct heap* heap = _heap;
+  if (!heap_attach_thread(heap))
+    flup_panic("Cannot attach thread!");
+  
+  struct root_ref* window = heap_alloc_with_descriptor(heap, &desc_array_of_messages, SHARED_RUNTIME_WINDOW_SIZE * sizeof(object_ref));
+  struct array_of_messages* deref = (void*) window->obj->data;
+  deref->length = SHARED_RUNTIME_WINDOW_SIZE;
+  
+  for (int i = 0; i < SHARED_RUNTIME_MESSAGE_COUNT; i++)
+    newMessageInto(heap, window->obj, offsetof(struct array_of_messages, messages[i % SHARED_RUNTIME_WINDOW_SIZE]), i);
+  heap_root_unref(heap, window);
+  
+  // Leave a cycle in flight so freeing the heap
+  // waits for it while unregistering
+  gc_start_cycle_async(heap->gen->gcState);
+  heap_detach_thread(heap);
+}
+
+// Few heaps on one runtime, so its scheduler and workers
+// pick cycles of multiple heaps from the queue
+static void testSharedRuntime() {
+  struct heap_options options = HEAP_OPTIONS_DEFAULT;
+  struct gc_runtime* runtime = gc_runtime_new(&options.gc, SHARED_RUNTIME_HEAP_COUNT);
+  if (!runtime)
+    flup_panic("Cannot create shared GC runtime");
+  options.gc.runtime = runtime;
+  
+  struct heap* heaps[SHARED_RUNTIME_HEAP_COUNT];
+  flup_thread* threads[SHARED_RUNTIME_HEAP_COUNT];
+  for (int i = 0; i < SHARED_RUNTIME_HEAP_COUNT; i++) {
+    if (!(heaps[i] = heap_new_with_options(SHARED_RUNTIME_HEAP_SIZE, &options)))
+      flup_panic("Cannot create heap number %d on shared runtime", i);
+    
+    // Creator is attached, don't let it hold up pauses
+    heap_enter_native(heaps[i]);
+  }
+  
+  for (int i = 0; i < SHARED_RUNTIME_HEAP_COUNT; i++)
+    if (!(threads[i] = flup_thread_new(sharedRuntimeRunner, heaps[i])))
+      flup_panic("Cannot create shared runtime runner number %d", i);
+  
+  for (int i = 0; i < SHARED_RUNTIME_HEAP_COUNT; i++) {
+    flup_thread_wait(threads[i]);
+    flup_thread_free(threads[i]);
+  }
+  
+  // Every heap must be gone before the runtime
+  for (int i = 0; i < SHARED_RUNTIME_HEAP_COUNT; i++) {
+    heap_exit_native(heaps[i]);
+    heap_free(heaps[i]);
+  }
+  gc_runtime_free(runtime);
+  pr_info("Shared runtime test completed");
+}
+
 [[gnu::used]]
 [[gnu::visibility("default")]]
 extern int fluffygc_impl_main();
@@ -136,15 +207,36 @@ extern int fluffygc_impl_main() {
   
   // Create 128 MiB heap
   size_t heapSize = 768 * 1024 * 1024;
-  struct heap* heap = heap_new(heapSize);
+  
+  // Allocation profile written there at exit if set
+  const char* allocProfileFile = getenv("FLUFFYGC_ALLOC_PROFILE");
+  struct heap_options options = HEAP_OPTIONS_DEFAULT;
+  if (allocProfileFile)
+    options.gc.allocProfilerSampleInterval = ALLOC_PROFILER_DEFAULT_SAMPLE_INTERVAL;
+  
+  struct heap* heap = heap_new_with_options(heapSize, &options);
   if (!heap) {
     pr_error("Error creating heap");
     return EXIT_FAILURE;
   }
   
+  // Messages are the majority of garbage
+  if (heap_add_recycled_type(heap, NULL, MESSAGE_SIZE) < 0)
+    flup_panic("Cannot make messages recycled");
+  
+  // Main thread don't touch the heap until heap_free
+  heap_enter_native(heap);
+  
+#ifdef CONFIG_TEST_SDL_STAT_PRINTER
   struct stat_printer* printer = NULL;
   if (!(printer = stat_printer_new(heap)))
     flup_panic("Failed to start stat printer!");
+#else
+  const char* statFile = getenv("FLUFFYGC_STAT_FILE");
+  struct stat_recorder* recorder = NULL;
+  if (!(recorder = stat_recorder_new(heap, statFile ? statFile : "stats.csv", 0)))
+    flup_panic("Failed to start stat recorder!");
+#endif
   
   // Puwge evewy 15 seconds
   mi_option_set(mi_option_purge_delay, 15'000);
@@ -185,9 +277,22 @@ extern int fluffygc_impl_main() {
   
   pr_info("Exiting... UwU");
   
+#ifdef CONFIG_TEST_SDL_STAT_PRINTER
   stat_printer_free(printer);
+#else
+  stat_recorder_free(recorder);
+#endif
   
+  if (allocProfileFile) {
+    int ret = gc_write_alloc_profile(heap->gen->gcState, allocProfileFile);
+    if (ret < 0)
+      pr_error("Cannot write allocation profile: %d", ret);
+  }
+  
+  heap_exit_native(heap);
   heap_free(heap);
+  
+  testSharedRuntime();
   flup_thread_free(flup_detach_thread());
   // mimalloc_play();
   
@@ -0,0 +1,129 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include <flup/bug.h>
+#include <flup/concurrency/mutex.h>
+
+#include "rcu.h"
+
+struct rcu_domain* rcu_domain_new() {
+  struct rcu_domain* self = malloc(sizeof(*self));
+  if (!self)
+    return NULL;
+
+  *self = (struct rcu_domain) {};
+  if (!(self->retireLock = flup_mutex_new())) {
+    free(self);
+    return NULL;
+  }
+  return self;
+}
+
+static void reclaimList(struct rcu_head* next) {
+  while (next) {
+    struct rcu_head* current = next;
+    next = next->next;
+    current->reclaim(current);
+  }
+}
+
+void rcu_domain_free(struct rcu_domain* self) {
+  if (!self)
+    return;
+
+  BUG_ON(atomic_load(&self->readers[0].count) != 0);
+  BUG_ON(atomic_load(&self->readers[1].count) != 0);
+
+  // Reclaiming may retire more
+  while (self->retiredHead || self->waitingHead) {
+    struct rcu_head* waiting = self->waitingHead;
+    struct rcu_head* retired = self->retiredHead;
+    self->waitingHead = NULL;
+    self->retiredHead = NULL;
+    reclaimList(waiting);
+    reclaimList(retired);
+  }
+
+  flup_mutex_free(self->retireLock);
+  free(self);
+}
+
+unsigned int rcu_read_enter(struct rcu_domain* self) {
+  while (1) {
+    unsigned long epoch = atomic_load(&self->epoch);
+    unsigned int index = (unsigned int) (epoch & 1);
+    atomic_fetch_add(&self->readers[index].count, 1);
+
+    // Epoch flipped before we got counted, poll might already
+    // checked the counter so retry on the new one
+    if (atomic_load(&self->epoch) == epoch)
+      return index;
+    atomic_fetch_sub(&self->readers[index].count, 1);
+  }
+}
+
+void rcu_read_exit(struct rcu_domain* self, unsigned int index) {
+  atomic_fetch_sub_explicit(&self->readers[index].count, 1, memory_order_release);
+}
+
+void rcu_retire(struct rcu_domain* self, struct rcu_head* head, void (*reclaim)(struct rcu_head* head)) {
+  head->reclaim = reclaim;
+
+  flup_mutex_lock(self->retireLock);
+  head->next = self->retiredHead;
+  self->retiredHead = head;
+  flup_mutex_unlock(self->retireLock);
+
+  rcu_poll(self);
+}
+
+void rcu_poll(struct rcu_domain* self) {
+  struct rcu_head* reclaimable = NULL;
+
+  flup_mutex_lock(self->retireLock);
+  unsigned long epoch = atomic_load(&self->epoch);
+
+  // Readers of previous epoch still around, try later
+  if (self->waitingHead && atomic_load(&self->readers[(epoch - 1) & 1].count) != 0)
+    goto not_yet;
+
+  reclaimable = self->waitingHead;
+  self->waitingHead = NULL;
+
+  // Start grace period for the newly retired ones, readers
+  // entering after this can't see them as they were
+  // unlinked before
+  if (self->retiredHead) {
+    self->waitingHead = self->retiredHead;
+    self->retiredHead = NULL;
+    atomic_store(&self->epoch, epoch + 1);
+
+    // Often there no readers at all
+    if (atomic_load(&self->readers[epoch & 1].count) == 0) {
+      struct rcu_head* tail = self->waitingHead;
+      while (tail->next)
+        tail = tail->next;
+      tail->next = reclaimable;
+      reclaimable = self->waitingHead;
+      self->waitingHead = NULL;
+    }
+  }
+
+not_yet:
+  flup_mutex_unlock(self->retireLock);
+
+  // Reclaim outside the lock, callbacks may retire more
+  reclaimList(reclaimable);
+}
+
+void rcu_list_del(struct rcu_list* self, struct rcu_list_node* node) {
+  _Atomic(struct rcu_list_node*)* prev = &self->head;
+  struct rcu_list_node* current;
+  while ((current = atomic_load_explicit(prev, memory_order_relaxed)) != node) {
+    BUG_ON(!current);
+    prev = &current->next;
+  }
+
+  atomic_store_explicit(prev, atomic_load_explicit(&node->next, memory_order_relaxed), memory_order_release);
+}
+
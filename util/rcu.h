@@ -0,0 +1,90 @@
+#ifndef UWU_3C8F0A52_7B1D_4E69_A4D2_5F09E6B3C711_UWU
+#define UWU_3C8F0A52_7B1D_4E69_A4D2_5F09E6B3C711_UWU
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include <flup/concurrency/mutex.h>
+
+// Epoch based RCU, readers only touch a counter so they
+// never wait for writers and writers never wait for readers.
+// Removed items are retired and reclaimed by whoever polls
+// once every reader which might seen them left
+//
+// There two reader counters, one for current epoch and one
+// for previous. Poll flips the epoch once and reclaims what
+// retired before the flip after previous epoch's counter
+// reaches zero, it never waits for that
+
+struct rcu_head {
+  struct rcu_head* next;
+  void (*reclaim)(struct rcu_head* head);
+};
+
+struct rcu_domain {
+  atomic_ulong epoch;
+
+  struct {
+    alignas(64) atomic_size_t count;
+  } readers[2];
+
+  // Protects the retired lists
+  flup_mutex* retireLock;
+
+  // Retired since last flip
+  struct rcu_head* retiredHead;
+  // Retired before last flip, waiting for readers
+  // of previous epoch to leave
+  struct rcu_head* waitingHead;
+};
+
+struct rcu_domain* rcu_domain_new();
+
+// Reclaims everything still retired, there must be no readers
+void rcu_domain_free(struct rcu_domain* self);
+
+// Returns index to be passed to rcu_read_exit, may be nested
+unsigned int rcu_read_enter(struct rcu_domain* self);
+void rcu_read_exit(struct rcu_domain* self, unsigned int index);
+
+// Reclaim "head" with "reclaim" once no readers can see it,
+// the item must be already unreachable to new readers
+void rcu_retire(struct rcu_domain* self, struct rcu_head* head, void (*reclaim)(struct rcu_head* head));
+
+// Reclaim whatever can be reclaimed without waiting
+void rcu_poll(struct rcu_domain* self);
+
+// Singly linked list which readers may walk while holding
+// read side. Writers must be serialized by caller and removed
+// node must be retired before it can be freed or reused
+struct rcu_list_node {
+  _Atomic(struct rcu_list_node*) next;
+};
+
+struct rcu_list {
+  _Atomic(struct rcu_list_node*) head;
+};
+
+#define RCU_LIST_INIT ((struct rcu_list) { .head = NULL })
+
+#define rcu_list_entry(ptr, type, member) ((type*) ((char*) (ptr) - offsetof(type, member)))
+
+#define rcu_list_for_each(list, current) \
+  for (current = atomic_load_explicit(&(list)->head, memory_order_acquire); \
+       current; \
+       current = atomic_load_explicit(&(current)->next, memory_order_acquire))
+
+static inline bool rcu_list_is_empty(struct rcu_list* self) {
+  return atomic_load_explicit(&self->head, memory_order_acquire) == NULL;
+}
+
+static inline void rcu_list_add_head(struct rcu_list* self, struct rcu_list_node* node) {
+  atomic_store_explicit(&node->next, atomic_load_explicit(&self->head, memory_order_relaxed), memory_order_relaxed);
+  atomic_store_explicit(&self->head, node, memory_order_release);
+}
+
+// Node's "next" kept so readers currently on it can continue
+void rcu_list_del(struct rcu_list* self, struct rcu_list_node* node);
+
+#endif
+